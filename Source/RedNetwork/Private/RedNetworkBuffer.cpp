@@ -0,0 +1,63 @@
+#include "RedNetworkBuffer.h"
+
+#include "Misc/ScopeLock.h"
+
+uint32 FRedNetworkBuffer::Release() const
+{
+	const uint32 Refs = --NumRefs;
+
+	if (Refs == 0)
+	{
+		FRedNetworkBuffer* MutableThis = const_cast<FRedNetworkBuffer*>(this);
+
+		// The pool may go away with this reference, so take it off the buffer first
+		TSharedPtr<FRedNetworkBufferPool, ESPMode::ThreadSafe> Owner = MoveTemp(MutableThis->Pool);
+
+		Owner->Return(MutableThis);
+	}
+
+	return Refs;
+}
+
+FRedNetworkBufferPool::~FRedNetworkBufferPool()
+{
+	for (FRedNetworkBuffer* Buffer : FreeBuffers)
+	{
+		delete Buffer;
+	}
+}
+
+FRedNetworkMessage FRedNetworkBufferPool::Acquire(int32 Size)
+{
+	FRedNetworkBuffer* Buffer = nullptr;
+
+	{
+		FScopeLock ScopeLock(&Lock);
+
+		if (FreeBuffers.Num() > 0) Buffer = FreeBuffers.Pop(false);
+	}
+
+	if (!Buffer) Buffer = new FRedNetworkBuffer();
+
+	Buffer->Data.SetNumUninitialized(Size, false);
+	Buffer->Pool = AsShared();
+
+	return FRedNetworkMessage(Buffer);
+}
+
+void FRedNetworkBufferPool::Return(FRedNetworkBuffer* Buffer)
+{
+	if (Buffer->Data.Max() > MaxPooledCapacity) Buffer->Data.Empty();
+
+	{
+		FScopeLock ScopeLock(&Lock);
+
+		if (FreeBuffers.Num() < MaxFreeBuffers)
+		{
+			FreeBuffers.Add(Buffer);
+			return;
+		}
+	}
+
+	delete Buffer;
+}
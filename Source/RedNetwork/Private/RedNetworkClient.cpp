@@ -1,6 +1,7 @@
 #include "RedNetworkClient.h"
 
 #include "KCPWrap.h"
+#include "RedNetworkFEC.h"
 #include "Logging.h"
 #include "Sockets.h"
 #include "IPAddress.h"
@@ -11,47 +12,148 @@ bool URedNetworkClient::Send(uint8 Channel, const TArray<uint8>& Data)
 {
 	if (!IsActive() || !IsLogged()) return false;
 
-	EnsureChannelCreated(Channel);
+	if (IsUnreliableChannel(Channel))
+	{
+		if (Data.Num() > GetMaxUnreliableSize(Channel))
+		{
+			UE_LOG(LogRedNetwork, Warning, TEXT("Unreliable message of %i bytes on channel %i exceeds %i bytes, dropped."), Data.Num(), Channel, GetMaxUnreliableSize(Channel));
+			return false;
+		}
+
+		const int32 SequenceSize = IsSequencedChannel(Channel) ? FRedNetworkSequence::HeaderSize : 0;
+
+		uint8* Dest = Output.Append(Channel, SequenceSize + Data.Num());
+
+		if (SequenceSize != 0) Sequences.FindOrAdd(Channel).WriteNext(Dest);
+
+		FMemory::Memcpy(Dest + SequenceSize, Data.GetData(), Data.Num());
+
+		return true;
+	}
+
+	FKCPWrap& KCPUnit = EnsureChannelCreated(Channel);
+
+	bool bOverflowed;
+	const bool bAdmitted = GetChannelConfig(Channel).Admit(KCPUnit, Data.Num(), bOverflowed);
+
+	if (bOverflowed) BlockedChannels.Add(Channel);
+
+	return bAdmitted && KCPUnit.Send(Data.GetData(), Data.Num()) == 0;
+}
+
+int32 URedNetworkClient::GetWaitSent(uint8 Channel) const
+{
+	const TSharedPtr<FKCPWrap>* KCPUnit = KCPUnits.Find(Channel);
 
-	return KCPUnits[Channel]->Send(Data.GetData(), Data.Num()) == 0;
+	return KCPUnit ? (*KCPUnit)->GetWaitSent() : 0;
 }
 
 void URedNetworkClient::UpdateKCP()
 {
-	int32 Current = FPlatformTime::Cycles64() / 1000;
+	const uint32 Current = FKCPWrap::Clock();
+
+	TArray<uint8, TInlineAllocator<16>> Order;
+
+	for (const auto& KCPUnit : KCPUnits)
+	{
+		VirtualTimes.FindOrAdd(KCPUnit.Channel);
+		Order.Add(KCPUnit.Channel);
+	}
+
+	if (ConnectionBytesPerTick > 0)
+	{
+		Order.Sort([this](uint8 A, uint8 B)
+		{
+			return FRedNetworkOutput::IsUpdatedBefore(GetChannelConfig(A).Priority, *VirtualTimes.Find(A), GetChannelConfig(B).Priority, *VirtualTimes.Find(B));
+		});
+	}
+
+	Output.RefillBudget(TickCount, ConnectionBytesPerTick);
+
+	for (uint8 Channel : Order)
+	{
+		FKCPWrap& KCPUnit = **KCPUnits.Find(Channel);
+
+		Output.UpdateChannel(*VirtualTimes.Find(Channel), GetChannelConfig(Channel).Weight, KCPUnit.GetKCPCB().mss, [this, Channel, &KCPUnit, Current](int32 MaxNewSegments)
+		{
+			UpdateChannel(Channel, KCPUnit, Current, MaxNewSegments);
+		});
+	}
+
+	Output.Flush();
+}
+
+void URedNetworkClient::HandleWritable()
+{
+	if (BlockedChannels.Num() == 0) return;
+
+	TArray<uint8, TInlineAllocator<8>> WritableChannels;
+
+	for (uint8 Channel : BlockedChannels)
+	{
+		const TSharedPtr<FKCPWrap>* KCPUnit = KCPUnits.Find(Channel);
+
+		if (!KCPUnit || GetChannelConfig(Channel).IsWritable(**KCPUnit)) WritableChannels.Add(Channel);
+	}
 
-	for (auto KCPUnit : KCPUnits)
+	// Broadcast after the walk, a handler may send and block the channel again
+	for (uint8 Channel : WritableChannels)
 	{
-		if (!KCPUnit) continue;
+		BlockedChannels.Remove(Channel);
 
-		KCPUnit->Update(Current);
+		OnWritable.Broadcast(Channel);
 	}
 }
 
+void URedNetworkClient::FClientOutput::SendTo(const uint8* Data, int32 Count)
+{
+	int32 BytesSend;
+	Client->SocketPtr->SendTo(Data, Count, BytesSend, *Client->ServerAddrPtr);
+}
+
+void URedNetworkClient::SendPacedDatagrams()
+{
+	Output.bPacing = IsPacingEnabled();
+
+	if (!Output.bPacing) return;
+
+	int64 Estimate = 0;
+
+	if (bEstimatePacingRate)
+	{
+		for (const auto& KCPUnit : KCPUnits)
+		{
+			Estimate += FRedNetworkPacer::EstimateRate(*KCPUnit.Value);
+		}
+	}
+
+	// Once per tick before anything is sent, the bucket serves the whole tick
+	Output.Pacer.Refill(FKCPWrap::Clock(), FRedNetworkPacer::CapRate(PacingRate, Estimate), PacingBurst);
+
+	Output.SendPacedDatagrams();
+}
+
 void URedNetworkClient::SendHeartbeat()
 {
-	SendBuffer.SetNumUninitialized(8, false);
+	// The pending datagram may hold records an OnWritable handler appended, they go out after the next update
+	uint8 Heartbeat[8];
 
-	ClientPass.ToBytes(SendBuffer.GetData());
+	ClientPass.ToBytes(Heartbeat);
 
 	int32 BytesSend;
-	SocketPtr->SendTo(SendBuffer.GetData(), SendBuffer.Num(), BytesSend, *ServerAddrPtr);
+	SocketPtr->SendTo(Heartbeat, sizeof(Heartbeat), BytesSend, *ServerAddrPtr);
 }
 
 void URedNetworkClient::HandleSocketRecv()
 {
-	ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get();
-	check(SocketSubsystem);
 	check(SocketPtr);
 	int32 BytesRead;
 
 	while (SocketPtr) {
 
-		TSharedRef<FInternetAddr> SourceAddr = SocketSubsystem->CreateInternetAddr();
-
 		RecvBuffer.SetNumUninitialized(65535, false);
 
-		if (!SocketPtr->RecvFrom(RecvBuffer.GetData(), RecvBuffer.Num(), BytesRead, *SourceAddr)) break;
+		if (!SocketPtr->RecvFrom(RecvBuffer.GetData(), RecvBuffer.Num(), BytesRead, *SourceAddrPtr)) break;
 
 		if (BytesRead < 8) continue;
 		RecvBuffer.SetNumUninitialized(BytesRead, false);
@@ -67,15 +169,34 @@ void URedNetworkClient::HandleSocketRecv()
 			LastRecvTime = NowTime;
 		}
 
-		if (RecvBuffer.Num() < 9) continue;
-
 		if (SourcePass.ID == ClientPass.ID && SourcePass.Key == ClientPass.Key)
 		{
-			uint8 Channel = RecvBuffer[8];
-
-			EnsureChannelCreated(Channel);
-
-			KCPUnits[Channel]->Input(RecvBuffer.GetData() + 9, RecvBuffer.Num() - 9);
+			FRedNetworkRecord Record;
+			int32 Offset = 8;
+
+			while (Record.Read(RecvBuffer.GetData(), RecvBuffer.Num(), Offset))
+			{
+				if (IsUnreliableChannel(Record.Channel))
+				{
+					HandleUnreliableRecv(Record);
+					continue;
+				}
+
+				FKCPWrap& KCPUnit = EnsureChannelCreated(Record.Channel);
+
+				const TSharedPtr<FRedNetworkFEC>* FEC = FECs.Find(Record.Channel);
+
+				if (!FEC)
+				{
+					KCPUnit.Input(Record.Data, Record.Count);
+					continue;
+				}
+
+				(*FEC)->Decode(Record.Data, Record.Count, [&KCPUnit](const uint8* Data, int32 Count)
+				{
+					KCPUnit.Input(Data, Count);
+				});
+			}
 		}
 	}
 }
@@ -84,18 +205,68 @@ void URedNetworkClient::HandleLoginRecv(const FRedNetworkPass & SourcePass)
 {
 	if (IsLogged()) return;
 
+	// The ready pass holds a provisional negative ID, it is echoed until the registered connection answers with its own under the same key
+	if (SourcePass.ID < 0)
+	{
+		ClientPass = SourcePass;
+		LastRecvTime = NowTime;
+		return;
+	}
+
+	if (ClientPass.ID >= 0 || SourcePass.Key != ClientPass.Key) return;
+
 	ClientPass = SourcePass;
 
-	KCPUnits.SetNum(256);
+	KCPUnits.Reset();
+	FECs.Reset();
+	VirtualTimes.Reset();
+	Output.Reset();
+	Output.Pass = ClientPass;
+	Sequences.Reset();
+	BlockedChannels.Reset();
+	UnreliableMessages.Reset();
 
 	OnLogin.Broadcast();
 }
 
+int32 URedNetworkClient::PollMessages(FRedNetworkMessageBatch& OutBatch)
+{
+	if (!IsActive() || !IsLogged()) return 0;
+
+	const int32 NumBefore = OutBatch.Num();
+
+	OutBatch.Append(UnreliableMessages);
+
+	UnreliableMessages.Reset();
+
+	for (const auto& KCPUnit : KCPUnits)
+	{
+		while (true)
+		{
+			const int32 Size = KCPUnit.Value->PeekSize();
+
+			if (Size < 0) break;
+
+			uint8* Dest = OutBatch.Add(ClientPass.ID, KCPUnit.Channel, Size);
+
+			if (KCPUnit.Value->Recv(Dest, Size) < 0)
+			{
+				OutBatch.Pop();
+				break;
+			}
+		}
+	}
+
+	return OutBatch.Num() - NumBefore;
+}
+
 void URedNetworkClient::HandleKCPRecv()
 {
-	for (int32 Channel = 0; Channel < KCPUnits.Num(); ++Channel)
+	// By index with the unit held, OnRecv may add a channel and move the table under this loop
+	for (int32 Index = 0; Index < KCPUnits.Num(); ++Index)
 	{
-		const TSharedPtr<FKCPWrap>& KCPUnit = KCPUnits[Channel];
+		const uint8 Channel = KCPUnits[Index].Channel;
+		const TSharedPtr<FKCPWrap> KCPUnit = KCPUnits[Index].Value;
 
 		while (KCPUnit)
 		{
@@ -103,58 +274,128 @@ void URedNetworkClient::HandleKCPRecv()
 
 			if (Size < 0) break;
 
-			RecvBuffer.SetNumUninitialized(Size, false);
+			FRedNetworkMessage Message = BufferPool->Acquire(Size);
 
-			Size = KCPUnit->Recv(RecvBuffer.GetData(), RecvBuffer.Num());
+			Size = KCPUnit->Recv(Message->Data.GetData(), Message->Data.Num());
 
 			if (Size < 0) break;
 
-			RecvBuffer.SetNumUninitialized(Size, false);
+			Message->Data.SetNumUninitialized(Size, false);
 
-			OnRecv.Broadcast(Channel, RecvBuffer);
+			BroadcastRecv(Channel, Message);
 		}
 	}
 }
 
+void URedNetworkClient::HandleUnreliableRecv(const FRedNetworkRecord& Record)
+{
+	const uint8* Data = Record.Data;
+	int32 Count = Record.Count;
+
+	if (IsSequencedChannel(Record.Channel))
+	{
+		if (Count < FRedNetworkSequence::HeaderSize) return;
+
+		if (!Sequences.FindOrAdd(Record.Channel).Accept(Data)) return;
+
+		Data += FRedNetworkSequence::HeaderSize;
+		Count -= FRedNetworkSequence::HeaderSize;
+	}
+
+	if (bPollMessages)
+	{
+		FMemory::Memcpy(UnreliableMessages.Add(ClientPass.ID, Record.Channel, Count), Data, Count);
+		return;
+	}
+
+	FRedNetworkMessage Message = BufferPool->Acquire(Count);
+
+	FMemory::Memcpy(Message->Data.GetData(), Data, Count);
+
+	BroadcastRecv(Record.Channel, Message);
+}
+
+void URedNetworkClient::BroadcastRecv(uint8 Channel, const FRedNetworkMessage& Message)
+{
+	OnNativeRecv.Broadcast(Channel, Message);
+
+	if (OnRecv.IsBound()) OnRecv.Broadcast(Channel, Message->Data);
+}
+
 void URedNetworkClient::HandleTimeout()
 {
 	if (IsLogged() && NowTime - LastRecvTime > TimeoutLimit)
 	{
 		ClientPass.Reset();
 
-		KCPUnits.SetNum(0);
+		KCPUnits.Reset();
+		FECs.Reset();
+		VirtualTimes.Reset();
+		Output.Reset();
+		Sequences.Reset();
+		BlockedChannels.Reset();
+		UnreliableMessages.Reset();
 
 		UE_LOG(LogRedNetwork, Warning, TEXT("Red Network Client timeout."));
 
 		OnUnlogin.Broadcast();
+		return;
 	}
+
+	// A ready pass the server never confirmed has expired there, start the handshake over
+	if (!IsLogged() && ClientPass.IsValid() && NowTime - LastRecvTime > TimeoutLimit) ClientPass.Reset();
 }
 
-void URedNetworkClient::EnsureChannelCreated(uint8 Channel)
+FKCPWrap& URedNetworkClient::EnsureChannelCreated(uint8 Channel)
 {
-	if (KCPUnits[Channel]) return;
+	TSharedPtr<FKCPWrap>& Slot = KCPUnits.FindOrAdd(Channel);
+
+	if (Slot) return *Slot;
+
+	const FRedNetworkChannelConfig& Config = GetChannelConfig(Channel);
 
 	TSharedPtr<FKCPWrap> KCPUnit = MakeShared<FKCPWrap>(0, FString::Printf(TEXT("Client-%i:%i"), ClientPass.ID, Channel));
-	KCPUnit->SetTurboMode();
+	KCPUnit->SetReserved(Config.GetReservedSize());
+	Config.Apply(*KCPUnit);
 	KCPUnit->GetKCPCB().logmask = KCPLogMask;
 
-	KCPUnit->OutputFunc = [this, Channel](const uint8* Data, int32 Count)->int32
-	{
-		SendBuffer.SetNumUninitialized(9, false);
-
-		ClientPass.ToBytes(SendBuffer.GetData());
+	TSharedPtr<FRedNetworkFEC> FEC = Config.CreateFEC();
 
-		SendBuffer[8] = Channel;
+	if (FEC) FECs.FindOrAdd(Channel) = FEC;
 
-		if (Count != 0) SendBuffer.Append(Data, Count);
+	KCPUnit->OutputFunc = [this, Channel, FEC](uint8* Packet, int32 Count)->int32
+	{
+		if (!FEC)
+		{
+			Output.Queue(Channel, Packet, Count);
+			return 0;
+		}
 
-		int32 BytesSend;
-		SocketPtr->SendTo(SendBuffer.GetData(), SendBuffer.Num(), BytesSend, *ServerAddrPtr);
+		FEC->Encode(Packet, Count, FKCPWrap::Clock(), [this, Channel](uint8* FECPacket, int32 FECCount)
+		{
+			Output.Queue(Channel, FECPacket, FECCount);
+		});
 
 		return 0;
 	};
 
-	KCPUnits[Channel] = KCPUnit;
+	Slot = KCPUnit;
+
+	return *KCPUnit;
+}
+
+void URedNetworkClient::UpdateChannel(uint8 Channel, FKCPWrap& KCPUnit, uint32 Current, int32 MaxNewSegments)
+{
+	KCPUnit.Update(Current, MaxNewSegments);
+
+	const TSharedPtr<FRedNetworkFEC>* FEC = FECs.Find(Channel);
+
+	if (!FEC) return;
+
+	(*FEC)->Flush(Current, [this, Channel](uint8* Packet, int32 Count)
+	{
+		Output.Queue(Channel, Packet, Count);
+	});
 }
 
 void URedNetworkClient::Tick(float DeltaTime)
@@ -162,11 +403,14 @@ void URedNetworkClient::Tick(float DeltaTime)
 	if (!IsActive()) return;
 
 	NowTime = FDateTime::Now();
+	++TickCount;
 
+	SendPacedDatagrams();
 	UpdateKCP();
+	HandleWritable();
 	SendHeartbeat();
 	HandleSocketRecv();
-	HandleKCPRecv();
+	if (!bPollMessages) HandleKCPRecv();
 	HandleTimeout();
 }
 
@@ -183,6 +427,8 @@ void URedNetworkClient::Activate(bool bReset)
 		return;
 	}
 
+	ChannelSettings = { UnreliableChannels, SequencedChannels, ChannelConfigs, DefaultChannelConfig };
+
 	ServerAddrPtr = SocketSubsystem->CreateInternetAddr();
 
 	bool bIsValid = false;
@@ -211,6 +457,12 @@ void URedNetworkClient::Activate(bool bReset)
 		return;
 	}
 
+	SourceAddrPtr = SocketSubsystem->CreateInternetAddr();
+	BufferPool = MakeShared<FRedNetworkBufferPool, ESPMode::ThreadSafe>();
+
+	Output.Client = this;
+	Output.BufferPool = BufferPool.Get();
+
 	ClientPass.Reset();
 	LastRecvTime = FDateTime::Now();
 	LastHeartbeat = FDateTime::MinValue();
@@ -232,12 +484,20 @@ void URedNetworkClient::Deactivate()
 	check(SocketSubsystem);
 	SocketSubsystem->DestroySocket(SocketPtr);
 
-	SendBuffer.SetNum(0);
 	RecvBuffer.SetNum(0);
 
+	SourceAddrPtr = nullptr;
+	BufferPool = nullptr;
+
 	ClientPass.Reset();
 
-	KCPUnits.SetNum(0);
+	KCPUnits.Reset();
+	FECs.Reset();
+	VirtualTimes.Reset();
+	Output.Reset();
+	Sequences.Reset();
+	BlockedChannels.Reset();
+	UnreliableMessages.Reset();
 
 	UE_LOG(LogRedNetwork, Log, TEXT("Red Network Client deactivate."));
 
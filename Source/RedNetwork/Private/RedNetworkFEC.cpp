@@ -0,0 +1,280 @@
+#include "RedNetworkFEC.h"
+
+#include "RedNetworkType.h"
+
+namespace FRedNetworkFECImpl
+{
+	/** KCP segment layout, see ikcp_encode_seg. */
+	constexpr int32 SegmentHeaderSize = 24;
+	constexpr int32 CommandOffset = 4;
+	constexpr int32 LengthOffset = 20;
+
+	constexpr uint8 PushCommand = 81;
+}
+
+FRedNetworkFEC::FRedNetworkFEC(int32 InDataShards, int32 InParityShards)
+	: DataShards(FMath::Clamp(InDataShards, 1, MaxDataShards))
+	, ParityShards(FMath::Clamp(InParityShards, 1, FMath::Min(MaxParityShards, DataShards)))
+{
+	SendParities.SetNum(ParityShards);
+}
+
+void FRedNetworkFEC::Encode(uint8* Packet, int32 Count, uint32 Current, FOutput Output)
+{
+	constexpr int32 Shift = ParityHeaderSize - DataHeaderSize;
+	constexpr int32 PayloadOffset = FRedNetworkRecord::FrameSize + ParityHeaderSize;
+
+	const uint8* Payload = Packet + PayloadOffset;
+	const int32 PayloadCount = Count - PayloadOffset;
+
+	uint8* Header = Packet + Shift + FRedNetworkRecord::FrameSize;
+
+	if (IsControlOnly(Payload, PayloadCount))
+	{
+		Header[0] = 0;
+		Header[1] = 0;
+		Header[2] = UnprotectedIndex;
+
+		Output(Packet + Shift, Count - Shift);
+		return;
+	}
+
+	if (SendIndex == 0) SendGroupTime = Current;
+
+	FParity& Parity = SendParities[SendIndex % ParityShards];
+
+	if (Parity.Buffer.Num() == 0) Parity.Buffer.SetNumZeroed(PayloadOffset, false);
+
+	const int32 ParityCount = Parity.Buffer.Num() - PayloadOffset;
+
+	if (PayloadCount > ParityCount) Parity.Buffer.AddZeroed(PayloadCount - ParityCount);
+
+	XorBytes(Parity.Buffer.GetData() + PayloadOffset, Payload, PayloadCount);
+	Parity.LengthXor ^= (uint16)PayloadCount;
+
+	Header[0] = SendGroup >> 0;
+	Header[1] = SendGroup >> 8;
+	Header[2] = SendIndex;
+
+	Output(Packet + Shift, Count - Shift);
+
+	if (++SendIndex == DataShards) CloseGroup(Output);
+}
+
+void FRedNetworkFEC::Flush(uint32 Current, FOutput Output)
+{
+	if (SendIndex == 0 || (int32)(Current - SendGroupTime) < GroupTimeout) return;
+
+	CloseGroup(Output);
+}
+
+bool FRedNetworkFEC::GetFlushTime(uint32& OutTime) const
+{
+	if (SendIndex == 0) return false;
+
+	OutTime = SendGroupTime + GroupTimeout;
+
+	return true;
+}
+
+void FRedNetworkFEC::CloseGroup(FOutput Output)
+{
+	const int32 Stripes = FMath::Min(SendIndex, ParityShards);
+
+	for (int32 Stripe = 0; Stripe < Stripes; ++Stripe)
+	{
+		FParity& Parity = SendParities[Stripe];
+
+		uint8* Header = Parity.Buffer.GetData() + FRedNetworkRecord::FrameSize;
+
+		Header[0] = SendGroup >> 0;
+		Header[1] = SendGroup >> 8;
+		Header[2] = 0x80 | Stripe;
+		Header[3] = SendIndex;
+		Header[4] = ParityShards;
+		Header[5] = Parity.LengthXor >> 0;
+		Header[6] = Parity.LengthXor >> 8;
+
+		Output(Parity.Buffer.GetData(), Parity.Buffer.Num());
+
+		// Keeps the capacity for the next group
+		Parity.Buffer.Reset();
+		Parity.LengthXor = 0;
+	}
+
+	++SendGroup;
+	SendIndex = 0;
+}
+
+bool FRedNetworkFEC::Decode(const uint8* Data, int32 Count, FInput Input)
+{
+	if (Count < DataHeaderSize) return false;
+
+	const uint16 Group = (uint16)Data[0] | (uint16)Data[1] << 8;
+	const uint8 Index = Data[2];
+
+	if (!(Index & 0x80))
+	{
+		const uint8* Payload = Data + DataHeaderSize;
+		const int32 PayloadCount = Count - DataHeaderSize;
+
+		if (Index == UnprotectedIndex)
+		{
+			Input(Payload, PayloadCount);
+			return true;
+		}
+
+		if (Index >= MaxDataShards) return false;
+
+		// KCP drops duplicates itself, pass the packet on before anything else
+		Input(Payload, PayloadCount);
+
+		FRecvGroup* RecvGroup = FindRecvGroup(Group);
+
+		if (!RecvGroup || (RecvGroup->DataMask & (1ull << Index))) return true;
+
+		RecvGroup->DataMask |= 1ull << Index;
+
+		if (RecvGroup->Shards.Num() <= Index) RecvGroup->Shards.SetNum(Index + 1);
+
+		RecvGroup->Shards[Index].Append(Payload, PayloadCount);
+
+		if (RecvGroup->ParityCount > 0) Recover(*RecvGroup, Index % RecvGroup->ParityCount, Input);
+
+		return true;
+	}
+
+	if (Count < ParityHeaderSize) return false;
+
+	const int32 Stripe = Index & 0x7F;
+	const int32 GroupDataCount = Data[3];
+	const int32 GroupParityCount = Data[4];
+
+	if (GroupDataCount < 1 || GroupDataCount > MaxDataShards) return false;
+	if (GroupParityCount < 1 || GroupParityCount > MaxParityShards || Stripe >= GroupParityCount) return false;
+
+	FRecvGroup* RecvGroup = FindRecvGroup(Group);
+
+	if (!RecvGroup || (RecvGroup->ParityMask & (1u << Stripe))) return true;
+
+	RecvGroup->DataCount = GroupDataCount;
+	RecvGroup->ParityCount = GroupParityCount;
+	RecvGroup->ParityMask |= 1u << Stripe;
+
+	if (RecvGroup->Parities.Num() <= Stripe) RecvGroup->Parities.SetNum(Stripe + 1);
+
+	FParity& Parity = RecvGroup->Parities[Stripe];
+	Parity.Buffer.Append(Data + ParityHeaderSize, Count - ParityHeaderSize);
+	Parity.LengthXor = (uint16)Data[5] | (uint16)Data[6] << 8;
+
+	Recover(*RecvGroup, Stripe, Input);
+
+	return true;
+}
+
+void FRedNetworkFEC::XorBytes(uint8* Dest, const uint8* Src, int32 Count)
+{
+	int32 Offset = 0;
+
+	for (; Offset + 16 <= Count; Offset += 16)
+	{
+		VectorIntStore(VectorIntXor(VectorIntLoad(Dest + Offset), VectorIntLoad(Src + Offset)), Dest + Offset);
+	}
+
+	for (; Offset < Count; ++Offset)
+	{
+		Dest[Offset] ^= Src[Offset];
+	}
+}
+
+FRedNetworkFEC::FRecvGroup* FRedNetworkFEC::FindRecvGroup(uint16 Group)
+{
+	FRecvGroup& RecvGroup = RecvGroups[Group % NumRecvGroups];
+
+	if (RecvGroup.bUsed && RecvGroup.Group == Group) return &RecvGroup;
+
+	// A group older than the one in its slot has been given up on
+	if (RecvGroup.bUsed && (int16)(Group - RecvGroup.Group) < 0) return nullptr;
+
+	RecvGroup.Group = Group;
+	RecvGroup.bUsed = true;
+	RecvGroup.DataCount = 0;
+	RecvGroup.ParityCount = 0;
+	RecvGroup.DataMask = 0;
+	RecvGroup.ParityMask = 0;
+
+	// Frees the buffers of the group given up on, a slot only holds what its current group received
+	RecvGroup.Shards.Reset();
+	RecvGroup.Parities.Reset();
+
+	return &RecvGroup;
+}
+
+bool FRedNetworkFEC::IsControlOnly(const uint8* Packet, int32 Count)
+{
+	using namespace FRedNetworkFECImpl;
+
+	int32 Offset = 0;
+
+	while (Offset + SegmentHeaderSize <= Count)
+	{
+		if (Packet[Offset + CommandOffset] == PushCommand) return false;
+
+		const uint8* Length = Packet + Offset + LengthOffset;
+		const uint32 SegmentLength = (uint32)Length[0] | (uint32)Length[1] << 8 | (uint32)Length[2] << 16 | (uint32)Length[3] << 24;
+
+		if (SegmentLength > (uint32)Count) return false;
+
+		Offset += SegmentHeaderSize + (int32)SegmentLength;
+	}
+
+	return true;
+}
+
+void FRedNetworkFEC::Recover(FRecvGroup& RecvGroup, int32 Stripe, FInput Input)
+{
+	if (!(RecvGroup.ParityMask & (1u << Stripe))) return;
+
+	int32 Missing = INDEX_NONE;
+
+	for (int32 Index = Stripe; Index < RecvGroup.DataCount; Index += RecvGroup.ParityCount)
+	{
+		if (RecvGroup.DataMask & (1ull << Index)) continue;
+
+		// XOR rebuilds a single loss per stripe
+		if (Missing != INDEX_NONE) return;
+
+		Missing = Index;
+	}
+
+	if (Missing == INDEX_NONE) return;
+
+	if (RecvGroup.Shards.Num() < RecvGroup.DataCount) RecvGroup.Shards.SetNum(RecvGroup.DataCount);
+
+	const FParity& Parity = RecvGroup.Parities[Stripe];
+
+	TArray<uint8>& Shard = RecvGroup.Shards[Missing];
+	Shard = Parity.Buffer;
+
+	uint16 Length = Parity.LengthXor;
+
+	for (int32 Index = Stripe; Index < RecvGroup.DataCount; Index += RecvGroup.ParityCount)
+	{
+		if (Index == Missing) continue;
+
+		const TArray<uint8>& Other = RecvGroup.Shards[Index];
+
+		if (Other.Num() > Shard.Num()) return;
+
+		XorBytes(Shard.GetData(), Other.GetData(), Other.Num());
+		Length ^= (uint16)Other.Num();
+	}
+
+	if (Length > Shard.Num()) return;
+
+	Shard.SetNum(Length, false);
+
+	RecvGroup.DataMask |= 1ull << Missing;
+
+	Input(Shard.GetData(), Shard.Num());
+}
@@ -0,0 +1,336 @@
+#include "RedNetworkLinuxSocket.h"
+
+#if PLATFORM_LINUX
+
+#include "Logging.h"
+#include "IPAddress.h"
+#include "SocketSubsystem.h"
+
+THIRD_PARTY_INCLUDES_START
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+THIRD_PARTY_INCLUDES_END
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+namespace
+{
+	/** Kernel limit on segments in one GSO send (UDP_MAX_SEGMENTS). */
+	constexpr int32 MaxSegments = 64;
+
+	/** Keeps a coalesced send under the IPv4 UDP payload limit. */
+	constexpr int32 MaxSegmentedBytes = 65000;
+}
+
+FRedNetworkLinuxSocket::FRedNetworkLinuxSocket()
+	: Socket(-1)
+	, WakeEvent(-1)
+	, NumPendingSends(0)
+	, bUseGSO(false)
+{
+	RecvSlots.SetNumUninitialized(BatchSize * RecvSlotSize);
+	SendSlots.SetNumUninitialized(BatchSize * SendSlotSize);
+
+	FMemory::Memzero(RecvMsgs);
+	FMemory::Memzero(SendMsgs);
+
+	for (int32 Index = 0; Index < BatchSize; ++Index)
+	{
+		RecvIovecs[Index].iov_base = RecvSlots.GetData() + Index * RecvSlotSize;
+		RecvIovecs[Index].iov_len = RecvSlotSize;
+		RecvMsgs[Index].msg_hdr.msg_iov = &RecvIovecs[Index];
+		RecvMsgs[Index].msg_hdr.msg_iovlen = 1;
+		RecvMsgs[Index].msg_hdr.msg_name = &RecvAddrs[Index];
+
+		SendIovecs[Index].iov_base = SendSlots.GetData() + Index * SendSlotSize;
+	}
+}
+
+FRedNetworkLinuxSocket::~FRedNetworkLinuxSocket()
+{
+	Close();
+}
+
+bool FRedNetworkLinuxSocket::Open(int32 Port, bool bReusePort)
+{
+	Socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (Socket < 0)
+	{
+		UE_LOG(LogRedNetwork, Error, TEXT("Socket creation failed (errno %i)."), errno);
+		return false;
+	}
+
+	if (bReusePort)
+	{
+		int Enable = 1;
+
+		if (setsockopt(Socket, SOL_SOCKET, SO_REUSEADDR, &Enable, sizeof(Enable)) != 0
+			|| setsockopt(Socket, SOL_SOCKET, SO_REUSEPORT, &Enable, sizeof(Enable)) != 0)
+		{
+			UE_LOG(LogRedNetwork, Error, TEXT("Socket set reuse port failed (errno %i)."), errno);
+			Close();
+			return false;
+		}
+	}
+
+	sockaddr_in BindAddr;
+	FMemory::Memzero(BindAddr);
+	BindAddr.sin_family = AF_INET;
+	BindAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	BindAddr.sin_port = htons(Port);
+
+	if (bind(Socket, (const sockaddr*)&BindAddr, sizeof(BindAddr)) != 0)
+	{
+		UE_LOG(LogRedNetwork, Error, TEXT("Socket bind failed (errno %i)."), errno);
+		Close();
+		return false;
+	}
+
+	int GSOSize = 0;
+	socklen_t GSOSizeLen = sizeof(GSOSize);
+
+	bUseGSO = getsockopt(Socket, SOL_UDP, UDP_SEGMENT, &GSOSize, &GSOSizeLen) == 0;
+
+	UE_LOG(LogRedNetwork, Log, TEXT("Socket UDP GSO %s."), bUseGSO ? TEXT("enabled") : TEXT("unsupported"));
+
+	WakeEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	return true;
+}
+
+int32 FRedNetworkLinuxSocket::GetPortNo() const
+{
+	sockaddr_in Addr;
+	socklen_t AddrLen = sizeof(Addr);
+
+	if (Socket < 0 || getsockname(Socket, (sockaddr*)&Addr, &AddrLen) != 0) return 0;
+
+	return ntohs(Addr.sin_port);
+}
+
+void FRedNetworkLinuxSocket::GetAddress(FInternetAddr& OutAddr) const
+{
+	sockaddr_in Addr;
+	socklen_t AddrLen = sizeof(Addr);
+
+	if (Socket < 0 || getsockname(Socket, (sockaddr*)&Addr, &AddrLen) != 0) return;
+
+	FromNativeAddr(Addr, OutAddr);
+}
+
+int32 FRedNetworkLinuxSocket::RecvBatch(TArray<FRedNetworkDatagram>& OutDatagrams)
+{
+	check(Socket >= 0);
+
+	OutDatagrams.SetNum(0, false);
+
+	// A fully truncated batch still means the socket may hold more
+	while (OutDatagrams.Num() == 0)
+	{
+		for (int32 Index = 0; Index < BatchSize; ++Index)
+		{
+			RecvMsgs[Index].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+			RecvMsgs[Index].msg_hdr.msg_flags = 0;
+		}
+
+		int NumMsgs = recvmmsg(Socket, RecvMsgs, BatchSize, MSG_DONTWAIT, nullptr);
+
+		if (NumMsgs <= 0) return 0;
+
+		for (int32 Index = 0; Index < NumMsgs; ++Index)
+		{
+			if (RecvMsgs[Index].msg_hdr.msg_flags & MSG_TRUNC) continue;
+
+			OutDatagrams.Add({ RecvSlots.GetData() + Index * RecvSlotSize, (int32)RecvMsgs[Index].msg_len, ToEndpoint(RecvAddrs[Index]) });
+		}
+	}
+
+	return OutDatagrams.Num();
+}
+
+void FRedNetworkLinuxSocket::SendTo(const uint8* Data, int32 Count, const FInternetAddr& Addr)
+{
+	check(Socket >= 0);
+
+	if (Count > SendSlotSize)
+	{
+		// Datagrams to one peer must leave in order, a sequenced channel drops whatever arrives behind a newer one
+		Flush();
+
+		sockaddr_in NativeAddr;
+		ToNativeAddr(Addr, NativeAddr);
+
+		sendto(Socket, Data, Count, MSG_DONTWAIT, (const sockaddr*)&NativeAddr, sizeof(NativeAddr));
+
+		return;
+	}
+
+	if (NumPendingSends == BatchSize) Flush();
+
+	FMemory::Memcpy(SendIovecs[NumPendingSends].iov_base, Data, Count);
+	SendIovecs[NumPendingSends].iov_len = Count;
+
+	ToNativeAddr(Addr, SendAddrs[NumPendingSends]);
+
+	++NumPendingSends;
+}
+
+void FRedNetworkLinuxSocket::Flush()
+{
+	int32 NumSent = 0;
+
+	while (NumSent < NumPendingSends)
+	{
+		int32 NumMsgs = BuildSendMsgs(NumSent);
+
+		int Result = sendmmsg(Socket, SendMsgs, NumMsgs, MSG_DONTWAIT);
+
+		// The kernel has UDP_SEGMENT but the device cannot segment, resend the rest one datagram at a time
+		if (Result < 0 && errno == EIO && bUseGSO)
+		{
+			UE_LOG(LogRedNetwork, Warning, TEXT("Socket UDP GSO rejected by device, disabled."));
+			bUseGSO = false;
+			continue;
+		}
+
+		// Like a failed FSocket::SendTo the datagrams are dropped, KCP resends what matters
+		if (Result <= 0) break;
+
+		NumSent = Result < NumMsgs ? SendMsgFirst[Result] : SendMsgFirst[NumMsgs - 1] + (int32)SendMsgs[NumMsgs - 1].msg_hdr.msg_iovlen;
+	}
+
+	NumPendingSends = 0;
+}
+
+int32 FRedNetworkLinuxSocket::BuildSendMsgs(int32 First)
+{
+	int32 NumMsgs = 0;
+
+	for (int32 Index = First; Index < NumPendingSends; ++NumMsgs)
+	{
+		int32 NumSegments = 1;
+
+		while (bUseGSO && NumSegments < MaxSegments && Index + NumSegments < NumPendingSends && CanCoalesce(Index, Index + NumSegments))
+		{
+			++NumSegments;
+		}
+
+		msghdr& Hdr = SendMsgs[NumMsgs].msg_hdr;
+		Hdr.msg_name = &SendAddrs[Index];
+		Hdr.msg_namelen = sizeof(sockaddr_in);
+		Hdr.msg_iov = &SendIovecs[Index];
+		Hdr.msg_iovlen = NumSegments;
+		Hdr.msg_control = nullptr;
+		Hdr.msg_controllen = 0;
+		Hdr.msg_flags = 0;
+
+		if (NumSegments > 1)
+		{
+			Hdr.msg_control = SendControls[NumMsgs];
+			Hdr.msg_controllen = sizeof(SendControls[NumMsgs]);
+
+			cmsghdr* Cmsg = CMSG_FIRSTHDR(&Hdr);
+			Cmsg->cmsg_level = SOL_UDP;
+			Cmsg->cmsg_type = UDP_SEGMENT;
+			Cmsg->cmsg_len = CMSG_LEN(sizeof(uint16));
+
+			uint16 SegmentSize = SendIovecs[Index].iov_len;
+			FMemory::Memcpy(CMSG_DATA(Cmsg), &SegmentSize, sizeof(SegmentSize));
+		}
+
+		SendMsgFirst[NumMsgs] = Index;
+
+		Index += NumSegments;
+	}
+
+	return NumMsgs;
+}
+
+bool FRedNetworkLinuxSocket::CanCoalesce(int32 First, int32 Next) const
+{
+	// Every segment but the last must be exactly the GSO size
+	if (SendIovecs[Next - 1].iov_len != SendIovecs[First].iov_len) return false;
+	if (SendIovecs[Next].iov_len > SendIovecs[First].iov_len) return false;
+
+	if ((Next - First + 1) * SendIovecs[First].iov_len > MaxSegmentedBytes) return false;
+
+	return SendAddrs[Next].sin_addr.s_addr == SendAddrs[First].sin_addr.s_addr
+		&& SendAddrs[Next].sin_port == SendAddrs[First].sin_port;
+}
+
+void FRedNetworkLinuxSocket::Wait(FTimespan Timeout)
+{
+	check(Socket >= 0);
+
+	pollfd Fds[2];
+	Fds[0].fd = Socket;
+	Fds[0].events = POLLIN;
+	Fds[0].revents = 0;
+	Fds[1].fd = WakeEvent;
+	Fds[1].events = POLLIN;
+	Fds[1].revents = 0;
+
+	// Round up so a deadline a fraction of a millisecond away does not spin
+	const int TimeoutMs = FMath::CeilToInt(FMath::Max(Timeout.GetTotalMilliseconds(), 0.0));
+
+	if (poll(Fds, WakeEvent >= 0 ? 2 : 1, TimeoutMs) <= 0) return;
+
+	if (Fds[1].revents & POLLIN)
+	{
+		eventfd_t Value;
+		eventfd_read(WakeEvent, &Value);
+	}
+}
+
+void FRedNetworkLinuxSocket::Wake()
+{
+	if (WakeEvent >= 0) eventfd_write(WakeEvent, 1);
+}
+
+void FRedNetworkLinuxSocket::Close()
+{
+	if (WakeEvent >= 0)
+	{
+		close(WakeEvent);
+		WakeEvent = -1;
+	}
+
+	if (Socket < 0) return;
+
+	Flush();
+
+	close(Socket);
+
+	Socket = -1;
+}
+
+void FRedNetworkLinuxSocket::ToNativeAddr(const FInternetAddr& Addr, sockaddr_in& OutAddr)
+{
+	uint32 Ip = 0;
+	Addr.GetIp(Ip);
+
+	FMemory::Memzero(OutAddr);
+	OutAddr.sin_family = AF_INET;
+	OutAddr.sin_addr.s_addr = htonl(Ip);
+	OutAddr.sin_port = htons(Addr.GetPort());
+}
+
+FRedNetworkEndpoint FRedNetworkLinuxSocket::ToEndpoint(const sockaddr_in& Addr)
+{
+	return FRedNetworkEndpoint::FromIPv4(ntohl(Addr.sin_addr.s_addr), ntohs(Addr.sin_port));
+}
+
+void FRedNetworkLinuxSocket::FromNativeAddr(const sockaddr_in& Addr, FInternetAddr& OutAddr)
+{
+	OutAddr.SetIp(ntohl(Addr.sin_addr.s_addr));
+	OutAddr.SetPort(ntohs(Addr.sin_port));
+}
+
+#endif
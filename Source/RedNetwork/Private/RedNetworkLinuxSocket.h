@@ -0,0 +1,79 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "RedNetworkSocket.h"
+
+#if PLATFORM_LINUX
+
+THIRD_PARTY_INCLUDES_START
+#include <sys/socket.h>
+#include <netinet/in.h>
+THIRD_PARTY_INCLUDES_END
+
+/**
+ * IPv4 socket that moves up to BatchSize datagrams per recvmmsg/sendmmsg call.
+ * Consecutive same-destination datagrams of equal size are coalesced into one UDP_SEGMENT (GSO) send when the kernel supports it.
+ */
+class FRedNetworkLinuxSocket : public FRedNetworkSocket
+{
+public:
+
+	static constexpr int32 BatchSize = 64;
+
+	/** Every datagram either end sends fits, a larger one arrives truncated and is dropped. */
+	static constexpr int32 RecvSlotSize = FRedNetworkRecord::MaxDatagramSize;
+
+	/** Larger datagrams are sent unbatched, after the pending batch. */
+	static constexpr int32 SendSlotSize = 2048;
+
+	FRedNetworkLinuxSocket();
+
+	virtual ~FRedNetworkLinuxSocket() override;
+
+	//~ Begin FRedNetworkSocket Interface
+	virtual bool Open(int32 Port, bool bReusePort) override;
+	virtual int32 GetPortNo() const override;
+	virtual void GetAddress(FInternetAddr& OutAddr) const override;
+	virtual int32 RecvBatch(TArray<FRedNetworkDatagram>& OutDatagrams) override;
+	virtual void SendTo(const uint8* Data, int32 Count, const FInternetAddr& Addr) override;
+	virtual void Flush() override;
+	virtual void Wait(FTimespan Timeout) override;
+	virtual void Wake() override;
+	virtual bool IsWakeable() const override { return WakeEvent >= 0; }
+	//~ End FRedNetworkSocket Interface
+
+protected:
+
+	int Socket;
+	int WakeEvent;
+
+	static void ToNativeAddr(const FInternetAddr& Addr, sockaddr_in& OutAddr);
+	static void FromNativeAddr(const sockaddr_in& Addr, FInternetAddr& OutAddr);
+	static FRedNetworkEndpoint ToEndpoint(const sockaddr_in& Addr);
+
+private:
+
+	TArray<uint8> RecvSlots;
+	sockaddr_in RecvAddrs[BatchSize];
+	iovec RecvIovecs[BatchSize];
+	mmsghdr RecvMsgs[BatchSize];
+
+	TArray<uint8> SendSlots;
+	sockaddr_in SendAddrs[BatchSize];
+	iovec SendIovecs[BatchSize];
+	mmsghdr SendMsgs[BatchSize];
+	int32 SendMsgFirst[BatchSize];
+	alignas(cmsghdr) uint8 SendControls[BatchSize][CMSG_SPACE(sizeof(uint16))];
+
+	int32 NumPendingSends;
+
+	bool bUseGSO;
+
+	void Close();
+
+	int32 BuildSendMsgs(int32 First);
+	bool CanCoalesce(int32 First, int32 Next) const;
+
+};
+
+#endif
@@ -0,0 +1,172 @@
+#include "RedNetworkOutput.h"
+
+bool FRedNetworkOutput::IsUpdatedBefore(int32 PriorityA, uint64 VirtualTimeA, int32 PriorityB, uint64 VirtualTimeB)
+{
+	if (PriorityA != PriorityB) return PriorityA > PriorityB;
+	return VirtualTimeA < VirtualTimeB;
+}
+
+void FRedNetworkOutput::RefillBudget(uint32 Tick, int32 InBytesPerTick)
+{
+	if (BudgetTick == Tick) return;
+
+	BudgetTick = Tick;
+	BytesPerTick = InBytesPerTick;
+
+	// Unused budget is lost, an overshoot is paid back by the following ticks
+	if (BytesPerTick > 0) Budget = FMath::Min<int64>(Budget, 0) + BytesPerTick;
+}
+
+void FRedNetworkOutput::UpdateChannel(uint64& ChannelTime, int32 Weight, uint32 MSS, TFunctionRef<void(int32 MaxNewSegments)> Update)
+{
+	int32 MaxNewSegments = MAX_int32;
+
+	// New data waits for the budget before it is emitted, ACKs and resends of a channel in debt still go out
+	if (BytesPerTick > 0)
+	{
+		const int64 SegmentSize = FMath::Max<int64>(MSS, 1);
+		MaxNewSegments = (int32)FMath::Clamp<int64>((Budget + SegmentSize - 1) / SegmentSize, 0, MAX_int32);
+	}
+
+	const uint64 OutputBefore = OutputBytes;
+
+	Update(MaxNewSegments);
+
+	const uint64 Output = OutputBytes - OutputBefore;
+
+	if (BytesPerTick > 0) Budget -= (int64)Output;
+
+	// Weighted fair share among equal priorities, a channel coming back from idle starts at the connection's clock
+	const uint64 StartTime = FMath::Max(ChannelTime, VirtualTime);
+	VirtualTime = StartTime;
+	ChannelTime = StartTime + Output * 256 / (uint64)FMath::Max(Weight, 1);
+}
+
+void FRedNetworkOutput::Queue(uint8 Channel, uint8* Packet, int32 Count)
+{
+	const uint8* Data = Packet + FRedNetworkRecord::FrameSize;
+	Count -= FRedNetworkRecord::FrameSize;
+
+	OutputBytes += FRedNetworkRecord::HeaderSize + Count;
+
+	if (PendingDatagram.Num() > 0 && PendingDatagram.Num() + FRedNetworkRecord::HeaderSize + Count > FRedNetworkRecord::MaxDatagramSize)
+	{
+		Flush();
+	}
+
+	// A packet too big to share its datagram is framed in the reserved room and sent from the KCP buffer as is
+	if (PendingDatagram.Num() == 0 && Count > FRedNetworkRecord::MaxDatagramSize / 2)
+	{
+		Pass.ToBytes(Packet);
+		FRedNetworkRecord::WriteHeader(Packet + 8, Channel, Count);
+
+		SendDatagram(Packet, FRedNetworkRecord::FrameSize + Count);
+
+		return;
+	}
+
+	FMemory::Memcpy(Append(Channel, Count), Data, Count);
+}
+
+uint8* FRedNetworkOutput::Append(uint8 Channel, int32 Count)
+{
+	if (PendingDatagram.Num() > 0 && PendingDatagram.Num() + FRedNetworkRecord::HeaderSize + Count > FRedNetworkRecord::MaxDatagramSize)
+	{
+		Flush();
+	}
+
+	if (PendingDatagram.Num() == 0)
+	{
+		PendingDatagram.SetNumUninitialized(8, false);
+
+		Pass.ToBytes(PendingDatagram.GetData());
+
+		OnPending();
+	}
+
+	return FRedNetworkRecord::AppendUninitialized(PendingDatagram, Channel, Count);
+}
+
+void FRedNetworkOutput::Flush()
+{
+	if (PendingDatagram.Num() == 0) return;
+
+	SendDatagram(PendingDatagram.GetData(), PendingDatagram.Num());
+
+	PendingDatagram.Reset();
+}
+
+void FRedNetworkOutput::SendDatagram(const uint8* Data, int32 Count)
+{
+	if (!bPacing)
+	{
+		SendTo(Data, Count);
+		return;
+	}
+
+	RefillPacing();
+
+	if (PacedDatagrams.Num() == 0 && CanSend())
+	{
+		Spend(Count);
+
+		SendTo(Data, Count);
+		return;
+	}
+
+	// Past the cap the datagram is lost like on a full link, KCP resends what it needs
+	if (PacedDatagrams.Num() >= MaxPacedDatagrams) return;
+
+	if (PacedDatagrams.Num() == 0) OnPaced();
+
+	// Held back, the bytes live in a KCP or send buffer that is reused right after
+	FRedNetworkMessage Datagram = BufferPool->Acquire(Count);
+
+	FMemory::Memcpy(Datagram->Data.GetData(), Data, Count);
+
+	PacedDatagrams.Add(MoveTemp(Datagram));
+}
+
+bool FRedNetworkOutput::SendPacedDatagrams()
+{
+	if (PacedDatagrams.Num() == 0) return false;
+
+	RefillPacing();
+
+	int32 NumSent = 0;
+
+	while (NumSent < PacedDatagrams.Num() && CanSend())
+	{
+		const TArray<uint8>& Datagram = PacedDatagrams[NumSent++]->Data;
+
+		Spend(Datagram.Num());
+
+		SendTo(Datagram.GetData(), Datagram.Num());
+	}
+
+	PacedDatagrams.RemoveAt(0, NumSent, false);
+
+	return PacedDatagrams.Num() > 0;
+}
+
+void FRedNetworkOutput::Reset()
+{
+	PendingDatagram.Reset();
+	PacedDatagrams.Reset();
+
+	OutputBytes = 0;
+	Budget = 0;
+	VirtualTime = 0;
+}
+
+bool FRedNetworkOutput::CanSend() const
+{
+	return Pacer.CanSend() && (!SharedPacer || SharedPacer->CanSend());
+}
+
+void FRedNetworkOutput::Spend(int32 Count)
+{
+	Pacer.Spend(Count);
+
+	if (SharedPacer) SharedPacer->Spend(Count);
+}
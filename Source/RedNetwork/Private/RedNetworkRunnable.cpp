@@ -0,0 +1,30 @@
+#include "RedNetworkRunnable.h"
+
+#include "KCPAllocator.h"
+
+FRedNetworkRunnable::FRedNetworkRunnable(TFunction<void()> InBody)
+	: Body(MoveTemp(InBody))
+	, bStopping(false)
+{
+}
+
+uint32 FRedNetworkRunnable::Run()
+{
+	while (!bStopping)
+	{
+		Body();
+	}
+
+	return 0;
+}
+
+void FRedNetworkRunnable::Stop()
+{
+	bStopping = true;
+}
+
+void FRedNetworkRunnable::Exit()
+{
+	// Threads come and go with Activate and Deactivate, what their cache holds goes back to the pools
+	FKCPAllocator::ReleaseThreadCache();
+}
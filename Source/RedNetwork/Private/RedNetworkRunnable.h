@@ -0,0 +1,26 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/Runnable.h"
+
+class FRedNetworkRunnable : public FRunnable
+{
+public:
+
+	FRedNetworkRunnable(TFunction<void()> InBody);
+
+	bool IsStopping() const { return bStopping; }
+
+	//~ Begin FRunnable Interface
+	virtual uint32 Run() override;
+	virtual void Stop() override;
+	virtual void Exit() override;
+	//~ End FRunnable Interface
+
+private:
+
+	TFunction<void()> Body;
+
+	TAtomic<bool> bStopping;
+
+};
@@ -1,34 +1,215 @@
 #include "RedNetworkServer.h"
 
 #include "KCPWrap.h"
+#include "RedNetworkFEC.h"
 #include "Logging.h"
 #include "Sockets.h"
 #include "IPAddress.h"
 #include "SocketSubsystem.h"
 #include "HAL/UnrealMemory.h"
+#include "HAL/RunnableThread.h"
+#include "Misc/ScopeLock.h"
+#include "RedNetworkRunnable.h"
+#include "RedNetworkSocket.h"
 #include "..\Public\RedNetworkServer.h"
 
 bool URedNetworkServer::Send(int32 ClientID, uint8 Channel, const TArray<uint8>& Data)
 {
-	if (!IsActive() || !Connections.Contains(ClientID)) return false;
+	if (!IsActive()) return false;
 
-	const FConnectionInfo& Info = Connections[ClientID];
+	if (IsUnreliableChannel(Channel) && Data.Num() > GetMaxUnreliableSize(Channel))
+	{
+		UE_LOG(LogRedNetwork, Warning, TEXT("Unreliable message of %i bytes on channel %i exceeds %i bytes, dropped."), Data.Num(), Channel, GetMaxUnreliableSize(Channel));
+		return false;
+	}
+
+	FShard& Shard = GetShard(ClientID);
+
+	if (Shard.Runnable)
+	{
+		// Same answer as the game thread path, a client is known once its OnLogin went out
+		if (!Shard.LoggedClients.Contains(ClientID)) return false;
+
+		if (IsSendRefused(ClientID, Channel))
+		{
+			Shard.SendRequests.Enqueue({ { ClientID }, Channel, nullptr });
+			Shard.Socket->Wake();
+			return false;
+		}
+
+		FRedNetworkMessage Payload = Shard.BufferPool->Acquire(Data.Num());
+
+		FMemory::Memcpy(Payload->Data.GetData(), Data.GetData(), Data.Num());
+
+		Shard.SendRequests.Enqueue({ { ClientID }, Channel, MoveTemp(Payload) });
+		Shard.Socket->Wake();
+		return true;
+	}
+
+	if (IsUnreliableChannel(Channel)) return SendUnreliable(Shard, MakeArrayView(&ClientID, 1), Channel, Data.GetData(), Data.Num()) == 1;
+
+	if (!FindConnection(Shard, ClientID)) return false;
+
+	return SendKCP(Shard, ClientID, Channel, Data.GetData(), Data.Num(), FKCPWrap::Clock());
+}
+
+int32 URedNetworkServer::SendToMany(const TArray<int32>& ClientIDs, uint8 Channel, const TArray<uint8>& Data)
+{
+	if (!IsActive()) return 0;
+
+	FRedNetworkMessage Payload = CreateMessage(Data.Num());
+
+	FMemory::Memcpy(Payload->Data.GetData(), Data.GetData(), Data.Num());
+
+	return SendMessageToMany(ClientIDs, Channel, Payload);
+}
+
+int32 URedNetworkServer::SendMessageToMany(TArrayView<const int32> ClientIDs, uint8 Channel, const FRedNetworkMessage& Payload)
+{
+	if (!IsActive() || !Payload) return 0;
+
+	const bool bUnreliable = IsUnreliableChannel(Channel);
+
+	if (bUnreliable && Payload->Data.Num() > GetMaxUnreliableSize(Channel))
+	{
+		UE_LOG(LogRedNetwork, Warning, TEXT("Unreliable message of %i bytes on channel %i exceeds %i bytes, dropped."), Payload->Data.Num(), Channel, GetMaxUnreliableSize(Channel));
+		return 0;
+	}
+
+	int32 NumSent = 0;
+
+	// Game thread shards still take unreliable sends as one group so the datagram is encoded once
+	TArray<int32, TInlineAllocator<16>> UnreliableIDs;
+
+	// Threaded shards get one request each, all of them sharing the payload
+	TArray<FSendRequest, TInlineAllocator<8>> Requests;
+	Requests.SetNum(Shards.Num());
+
+	// Refused sends of threaded shards, the network thread marks their channels blocked
+	TArray<FSendRequest, TInlineAllocator<8>> Refusals;
+	Refusals.SetNum(Shards.Num());
+
+	for (int32 ClientID : ClientIDs)
+	{
+		FShard& Shard = GetShard(ClientID);
+
+		if (Shard.Runnable)
+		{
+			if (!Shard.LoggedClients.Contains(ClientID)) continue;
+
+			if (IsSendRefused(ClientID, Channel))
+			{
+				Refusals[Shard.Index].ClientIDs.Add(ClientID);
+				continue;
+			}
+
+			Requests[Shard.Index].ClientIDs.Add(ClientID);
+			++NumSent;
+			continue;
+		}
+
+		if (bUnreliable)
+		{
+			UnreliableIDs.Add(ClientID);
+			continue;
+		}
+
+		if (!FindConnection(Shard, ClientID)) continue;
+
+		if (SendKCP(Shard, ClientID, Channel, Payload->Data.GetData(), Payload->Data.Num(), FKCPWrap::Clock())) ++NumSent;
+	}
+
+	for (const TUniquePtr<FShard>& Shard : Shards)
+	{
+		if (UnreliableIDs.Num() == 0) break;
+		if (Shard->Runnable) continue;
+
+		TArray<int32, TInlineAllocator<16>> ShardIDs;
+
+		for (int32 ClientID : UnreliableIDs)
+		{
+			if (&GetShard(ClientID) == Shard.Get()) ShardIDs.Add(ClientID);
+		}
+
+		if (ShardIDs.Num() > 0) NumSent += SendUnreliable(*Shard, ShardIDs, Channel, Payload->Data.GetData(), Payload->Data.Num());
+	}
+
+	for (FSendRequest& Request : Requests)
+	{
+		if (Request.ClientIDs.Num() == 0) continue;
+
+		FShard& Shard = GetShard(Request.ClientIDs[0]);
+
+		Request.Channel = Channel;
+		Request.Payload = Payload;
+
+		Shard.SendRequests.Enqueue(MoveTemp(Request));
+		Shard.Socket->Wake();
+	}
+
+	for (FSendRequest& Refusal : Refusals)
+	{
+		if (Refusal.ClientIDs.Num() == 0) continue;
+
+		FShard& Shard = GetShard(Refusal.ClientIDs[0]);
+
+		Refusal.Channel = Channel;
+
+		Shard.SendRequests.Enqueue(MoveTemp(Refusal));
+		Shard.Socket->Wake();
+	}
+
+	return NumSent;
+}
+
+bool URedNetworkServer::IsSendRefused(int32 ClientID, uint8 Channel) const
+{
+	const FRedNetworkChannelConfig& Config = GetChannelConfig(Channel);
 
-	EnsureChannelCreated(ClientID, Channel);
+	if (IsUnreliableChannel(Channel) || Config.MaxWaitSent <= 0 || Config.OverflowPolicy != ERedNetworkOverflowPolicy::Reject) return false;
+
+	// Only this answer reaches the caller, what passes here is always admitted by the network thread
+	return GetWaitSent(ClientID, Channel) >= Config.MaxWaitSent;
+}
+
+int32 URedNetworkServer::GetWaitSent(int32 ClientID, uint8 Channel) const
+{
+	if (!IsActive()) return 0;
+
+	FShard& Shard = GetShard(ClientID);
+
+	if (Shard.Runnable)
+	{
+		FScopeLock ScopeLock(&Shard.WaitSentLock);
+
+		const int32* WaitSent = Shard.WaitSent.Find(MakeChannelKey(ClientID, Channel));
+
+		return WaitSent ? *WaitSent : 0;
+	}
+
+	FConnectionInfo* Info = FindConnection(Shard, ClientID);
+	const FChannelInfo* ChannelInfo = Info ? Info->Channels.Find(Channel) : nullptr;
+
+	return ChannelInfo && ChannelInfo->KCPUnit ? ChannelInfo->KCPUnit->GetWaitSent() : 0;
+}
+
+FRedNetworkMessage URedNetworkServer::CreateMessage(int32 Size) const
+{
+	if (Shards.Num() == 0) return nullptr;
 
-	return Info.KCPUnits[Channel]->Send(Data.GetData(), Data.Num()) == 0;
+	return Shards[0]->BufferPool->Acquire(Size);
 }
 
 TSharedPtr<FInternetAddr> URedNetworkServer::GetSocketAddr() const
 {
-	if (!SocketPtr) return nullptr;
+	if (Shards.Num() == 0 || !Shards[0]->Socket) return nullptr;
 
 	ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get();
 	check(SocketSubsystem);
 
 	TSharedRef<FInternetAddr> Addr = SocketSubsystem->CreateInternetAddr();
 
-	SocketPtr->GetAddress(*Addr);
+	Shards[0]->Socket->GetAddress(*Addr);
 
 	return Addr;
 }
@@ -40,151 +221,610 @@ FString URedNetworkServer::GetSocketAddrString() const
 	return Addr ? Addr->ToString(true) : TEXT("");
 }
 
-void URedNetworkServer::UpdateKCP()
+URedNetworkServer::FShard& URedNetworkServer::GetShard(int32 ClientID) const
+{
+	check(Shards.Num() > 0);
+
+	return *Shards[(uint32)ClientID % (uint32)Shards.Num()];
+}
+
+int32 URedNetworkServer::MakeClientID(const FShard& Shard, int32 SlotIndex, uint32 Generation) const
+{
+	return (int32)((Generation << SlotIndexBits | (uint32)SlotIndex) * (uint32)Shards.Num() + (uint32)Shard.Index);
+}
+
+int32 URedNetworkServer::MakeReadyID(FShard& Shard) const
+{
+	const uint32 NumIDShards = (uint32)Shards.Num();
+
+	// Provisional IDs take the negative half so they never name a connection, yet still route by ID % Shards.Num()
+	const uint32 First = 0x80000000u + ((uint32)Shard.Index + NumIDShards - 0x80000000u % NumIDShards) % NumIDShards;
+	const uint32 NumReadyIDs = (MAX_uint32 - First) / NumIDShards + 1;
+
+	return (int32)(First + Shard.NextReadyID++ % NumReadyIDs * NumIDShards);
+}
+
+void URedNetworkServer::SplitClientID(int32 ClientID, int32& OutSlotIndex, uint32& OutGeneration) const
+{
+	const uint32 LocalID = (uint32)ClientID / (uint32)Shards.Num();
+
+	OutSlotIndex = LocalID & ((1u << SlotIndexBits) - 1);
+	OutGeneration = LocalID >> SlotIndexBits;
+}
+
+URedNetworkServer::FConnectionInfo* URedNetworkServer::FindConnection(FShard& Shard, int32 ClientID) const
+{
+	int32 SlotIndex;
+	uint32 Generation;
+	SplitClientID(ClientID, SlotIndex, Generation);
+
+	return Shard.Connections.Find(SlotIndex, Generation);
+}
+
+void URedNetworkServer::ReleaseClientID(FShard& Shard, int32 ClientID) const
+{
+	int32 SlotIndex;
+	uint32 Generation;
+	SplitClientID(ClientID, SlotIndex, Generation);
+
+	Shard.Connections.Release(SlotIndex, Generation);
+}
+
+void URedNetworkServer::TickNetwork(FShard& Shard)
+{
+	Shard.NowTime = FDateTime::Now();
+	Shard.KCPClock = FKCPWrap::Clock();
+	++Shard.TickCount;
+
+	HandleSendRequests(Shard);
+	UpdateKCP(Shard);
+	SendHeartbeat(Shard);
+	HandleSocketRecv(Shard);
+	HandleForwardedPackets(Shard);
+	HandleKCPRecv(Shard);
+	HandleExpiredReadyPass(Shard);
+	HandleExpiredConnection(Shard);
+
+	SendPacedDatagrams(Shard);
+	FlushPendingOutputs(Shard);
+
+	Shard.Socket->Flush();
+
+	PublishNetworkEvents(Shard);
+}
+
+void URedNetworkServer::WaitNetwork(FShard& Shard)
+{
+	if (!bEventDrivenWakeup)
+	{
+		FPlatformProcess::Sleep(NetworkThreadInterval.GetTotalSeconds());
+		return;
+	}
+
+	// Heartbeats and timeouts are checked at heartbeat granularity
+	FTimespan Timeout = Heartbeat;
+
+	if (Shard.KCPTimers.Num() > 0)
+	{
+		const int32 Delay = (int32)(Shard.KCPTimers.HeapTop().Time - FKCPWrap::Clock());
+
+		Timeout = FMath::Min(Timeout, FTimespan::FromMilliseconds(FMath::Max(Delay, 0)));
+	}
+
+	// Held datagrams are released as the buckets refill
+	if (Shard.PacedConnections.Num() > 0) Timeout = FMath::Min(Timeout, FTimespan::FromMilliseconds(1.0));
+
+	// Without a wake-up channel queued sends wait for the socket timeout
+	if (!Shard.Socket->IsWakeable()) Timeout = FMath::Min(Timeout, NetworkThreadInterval);
+
+	Shard.Socket->Wait(Timeout);
+}
+
+void URedNetworkServer::HandleSendRequests(FShard& Shard)
 {
-	int32 Current = FPlatformTime::Cycles64() / 1000;
+	FSendRequest Request;
 
-	for (auto Info : Connections)
+	while (Shard.SendRequests.Dequeue(Request))
 	{
-		for (auto KCPUnit : Info.Value.KCPUnits)
+		// A send refused on the game thread, the next update notifies once the channel is writable
+		if (!Request.Payload)
+		{
+			for (int32 ClientID : Request.ClientIDs)
+			{
+				if (!FindConnection(Shard, ClientID)) continue;
+
+				EnsureChannelCreated(Shard, ClientID, Request.Channel).bBlocked = true;
+
+				ScheduleKCP(Shard, ClientID, Request.Channel, Shard.KCPClock);
+			}
+
+			continue;
+		}
+
+		const TArray<uint8>& Data = Request.Payload->Data;
+
+		if (IsUnreliableChannel(Request.Channel))
+		{
+			SendUnreliable(Shard, Request.ClientIDs, Request.Channel, Data.GetData(), Data.Num());
+			continue;
+		}
+
+		for (int32 ClientID : Request.ClientIDs)
 		{
-			if (!KCPUnit) continue;
+			if (!FindConnection(Shard, ClientID)) continue;
 
-			KCPUnit->Update(Current);
+			// Already reported as sent, several sends of one tick may overshoot the cap until the game thread sees it
+			SendKCP(Shard, ClientID, Request.Channel, Data.GetData(), Data.Num(), Shard.KCPClock, false);
 		}
 	}
 }
 
-void URedNetworkServer::SendHeartbeat()
+void URedNetworkServer::HandleForwardedPackets(FShard& Shard)
 {
-	for (auto Info : Connections)
+	FForwardedPacket Packet;
+
+	while (Shard.ForwardedPackets.Dequeue(Packet))
 	{
-		SendBuffer.SetNumUninitialized(8, false);
+		HandlePacket(Shard, { Packet.Data.GetData(), Packet.Data.Num(), Packet.Endpoint });
+	}
+}
 
-		Info.Value.Pass.ToBytes(SendBuffer.GetData());
+void URedNetworkServer::HandleNetworkEvents()
+{
+	TArray<FRedNetworkEvent> Events;
 
-		int32 BytesSend;
-		SocketPtr->SendTo(SendBuffer.GetData(), SendBuffer.Num(), BytesSend, *Info.Value.Addr);
+	for (const TUniquePtr<FShard>& Shard : Shards)
+	{
+		while (Shard->NetworkEvents.Dequeue(Events))
+		{
+			for (const FRedNetworkEvent& Event : Events)
+			{
+				switch (Event.Type)
+				{
+				case ERedNetworkEvent::Login:
+					Shard->LoggedClients.Add(Event.ClientID);
+					OnLogin.Broadcast(Event.ClientID);
+					break;
+				case ERedNetworkEvent::Recv:
+					BroadcastRecv(Event.ClientID, Event.Channel, Event.Message);
+					break;
+				case ERedNetworkEvent::Unlogin:
+					Shard->LoggedClients.Remove(Event.ClientID);
+					OnUnlogin.Broadcast(Event.ClientID);
+					break;
+				case ERedNetworkEvent::Writable:
+					OnWritable.Broadcast(Event.ClientID, Event.Channel);
+					break;
+				}
+			}
+
+			// Drops the message references, the batch goes back to the network thread with its capacity
+			Events.Reset();
+
+			Shard->RecycledEvents.Enqueue(MoveTemp(Events));
+		}
 	}
 }
 
-void URedNetworkServer::HandleSocketRecv()
+void URedNetworkServer::PublishNetworkEvents(FShard& Shard)
 {
-	ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get();
-	check(SocketSubsystem);
-	check(SocketPtr);
-	int32 BytesRead;
+	if (!Shard.Runnable) return;
 
-	while (SocketPtr) {
+	if (Shard.WaitSentUpdates.Num() > 0)
+	{
+		FScopeLock ScopeLock(&Shard.WaitSentLock);
 
-		TSharedRef<FInternetAddr> SourceAddr = SocketSubsystem->CreateInternetAddr();
+		for (const TPair<uint64, int32>& Update : Shard.WaitSentUpdates)
+		{
+			if (Update.Value > 0) Shard.WaitSent.Add(Update.Key, Update.Value);
+			else Shard.WaitSent.Remove(Update.Key);
+		}
+
+		Shard.WaitSentUpdates.Reset();
+	}
+
+	if (Shard.PendingEvents.Num() > 0)
+	{
+		Shard.NetworkEvents.Enqueue(MoveTemp(Shard.PendingEvents));
+
+		Shard.PendingEvents.Reset();
+
+		Shard.RecycledEvents.Dequeue(Shard.PendingEvents);
+	}
+
+	if (Shard.PendingMessages.Num() > 0)
+	{
+		Shard.QueuedMessageBytes += Shard.PendingMessages.Arena.Num();
 
-		RecvBuffer.SetNumUninitialized(65535, false);
+		Shard.MessageBatches.Enqueue(MoveTemp(Shard.PendingMessages));
 
-		if (!SocketPtr->RecvFrom(RecvBuffer.GetData(), RecvBuffer.Num(), BytesRead, *SourceAddr)) break;
+		Shard.PendingMessages.Reset();
 
-		if (RecvBuffer.Num() < 8) continue;
-		RecvBuffer.SetNumUninitialized(BytesRead, false);
+		Shard.RecycledMessages.Dequeue(Shard.PendingMessages);
+	}
+}
+
+int32 URedNetworkServer::PollMessages(FRedNetworkMessageBatch& OutBatch)
+{
+	const int32 NumBefore = OutBatch.Num();
 
-		FRedNetworkPass SourcePass(RecvBuffer.GetData());
+	FRedNetworkMessageBatch Batch;
 
-		if (!SourcePass.IsValid())
+	for (const TUniquePtr<FShard>& Shard : Shards)
+	{
+		if (!Shard->Runnable)
 		{
-			SendReadyPass(SourceAddr);
+			OutBatch.Append(Shard->PendingMessages);
+
+			Shard->PendingMessages.Reset();
+
 			continue;
 		}
 
-		RedirectConnection(SourcePass, SourceAddr);
-		RegisterConnection(SourcePass, SourceAddr);
-	
-		if (!Connections.Contains(SourcePass.ID)) continue;
+		while (Shard->MessageBatches.Dequeue(Batch))
+		{
+			Shard->QueuedMessageBytes -= Batch.Arena.Num();
+
+			OutBatch.Append(Batch);
+
+			Batch.Reset();
+
+			Shard->RecycledMessages.Enqueue(MoveTemp(Batch));
+		}
+	}
+
+	return OutBatch.Num() - NumBefore;
+}
+
+void URedNetworkServer::BroadcastRecv(int32 ClientID, uint8 Channel, const FRedNetworkMessage& Message)
+{
+	OnNativeRecv.Broadcast(ClientID, Channel, Message);
+
+	// Skip the reflected dispatch entirely when only native handlers listen
+	if (OnRecv.IsBound()) OnRecv.Broadcast(ClientID, Channel, Message->Data);
+}
+
+void URedNetworkServer::NotifyLogin(FShard& Shard, int32 ClientID)
+{
+	if (Shard.Runnable) Shard.PendingEvents.Add({ ERedNetworkEvent::Login, ClientID, 0, nullptr });
+	else OnLogin.Broadcast(ClientID);
+}
+
+void URedNetworkServer::NotifyRecv(FShard& Shard, int32 ClientID, uint8 Channel, const FRedNetworkMessage& Message)
+{
+	if (Shard.Runnable) Shard.PendingEvents.Add({ ERedNetworkEvent::Recv, ClientID, Channel, Message });
+	else BroadcastRecv(ClientID, Channel, Message);
+}
 
-		Connections[SourcePass.ID].RecvTime = NowTime;
+void URedNetworkServer::NotifyUnlogin(FShard& Shard, int32 ClientID)
+{
+	if (Shard.Runnable) Shard.PendingEvents.Add({ ERedNetworkEvent::Unlogin, ClientID, 0, nullptr });
+	else OnUnlogin.Broadcast(ClientID);
+}
 
-		if (RecvBuffer.Num() < 9) continue;
+void URedNetworkServer::NotifyWritable(FShard& Shard, int32 ClientID, uint8 Channel)
+{
+	if (Shard.Runnable) Shard.PendingEvents.Add({ ERedNetworkEvent::Writable, ClientID, Channel, nullptr });
+	else OnWritable.Broadcast(ClientID, Channel);
+}
+
+void URedNetworkServer::UpdateKCP(FShard& Shard)
+{
+	const uint32 Current = Shard.KCPClock;
+
+	Shard.DueChannels.Reset();
+
+	// Take every due channel first so the channels of one connection flush in scheduling order
+	while (Shard.KCPTimers.Num() > 0 && (int32)(Shard.KCPTimers.HeapTop().Time - Current) <= 0)
+	{
+		FKCPTimer Timer;
+		Shard.KCPTimers.HeapPop(Timer, false);
 
-		if (Connections.Contains(SourcePass.ID))
+		FConnectionInfo* Info = FindConnection(Shard, Timer.ClientID);
+
+		if (!Info) continue;
+
+		FChannelInfo* ChannelInfo = Info->Channels.Find(Timer.Channel);
+
+		if (!ChannelInfo || !ChannelInfo->bScheduled || ChannelInfo->UpdateTime != Timer.Time) continue;
+
+		ChannelInfo->bScheduled = false;
+
+		Shard.DueChannels.Add({ Timer.ClientID, Timer.Channel, GetChannelConfig(Timer.Channel).Priority, ChannelInfo->VirtualTime });
+	}
+
+	if (ConnectionBytesPerTick > 0)
+	{
+		Shard.DueChannels.Sort([](const FDueChannel& A, const FDueChannel& B)
 		{
-			uint8 Channel = RecvBuffer[8];
+			if (A.ClientID != B.ClientID) return A.ClientID < B.ClientID;
+			return FRedNetworkOutput::IsUpdatedBefore(A.Priority, A.VirtualTime, B.Priority, B.VirtualTime);
+		});
+	}
+
+	for (const FDueChannel& Timer : Shard.DueChannels)
+	{
+		FConnectionInfo* Info = FindConnection(Shard, Timer.ClientID);
+
+		if (!Info) continue;
+
+		FChannelInfo* ChannelInfo = Info->Channels.Find(Timer.Channel);
+
+		if (!ChannelInfo) continue;
+
+		FConnectionOutput& Output = Info->Output;
 
-			EnsureChannelCreated(SourcePass.ID, Channel);
+		Output.RefillBudget(Shard.TickCount, ConnectionBytesPerTick);
 
-			Connections[SourcePass.ID].KCPUnits[Channel]->Input(RecvBuffer.GetData() + 9, RecvBuffer.Num() - 9);
+		Output.UpdateChannel(ChannelInfo->VirtualTime, GetChannelConfig(Timer.Channel).Weight, ChannelInfo->KCPUnit->GetKCPCB().mss, [ChannelInfo, &Output, &Timer, Current](int32 MaxNewSegments)
+		{
+			ChannelInfo->KCPUnit->Update(Current, MaxNewSegments);
+
+			if (!ChannelInfo->FEC) return;
+
+			ChannelInfo->FEC->Flush(Current, [&Output, &Timer](uint8* Packet, int32 Count)
+			{
+				Output.Queue(Timer.Channel, Packet, Count);
+			});
+		});
+
+		const int32 WaitSent = ChannelInfo->KCPUnit->GetWaitSent();
+
+		if (Shard.Runnable && WaitSent != ChannelInfo->PublishedWaitSent)
+		{
+			ChannelInfo->PublishedWaitSent = WaitSent;
+
+			Shard.WaitSentUpdates.Add({ MakeChannelKey(Timer.ClientID, Timer.Channel), WaitSent });
 		}
+
+		const bool bWritable = ChannelInfo->bBlocked && GetChannelConfig(Timer.Channel).IsWritable(*ChannelInfo->KCPUnit);
+
+		if (bWritable) ChannelInfo->bBlocked = false;
+
+		// An idle unit leaves the timers until HandlePacket or SendKCP wakes it, an open FEC group keeps its own deadline
+		const bool bIdle = ChannelInfo->KCPUnit->IsIdle();
+
+		uint32 FECTime = 0;
+		const bool bFECOpen = ChannelInfo->FEC && ChannelInfo->FEC->GetFlushTime(FECTime);
+
+		if (!bIdle || bFECOpen)
+		{
+			uint32 NextTime = bIdle ? FECTime : ChannelInfo->KCPUnit->Check(Current);
+
+			// Queued data held back by the budget is retried on the next tick
+			if (!bIdle && ConnectionBytesPerTick > 0 && ChannelInfo->KCPUnit->GetKCPCB().nsnd_que > 0) NextTime = Current + 1;
+
+			if (bFECOpen && (int32)(FECTime - NextTime) < 0) NextTime = FECTime;
+
+			// ikcp_check answers "now" for a due resend that waits on the next flush, so never reschedule into this pass
+			if ((int32)(NextTime - Current) <= 0) NextTime = Current + 1;
+
+			ScheduleKCP(Shard, Timer.ClientID, Timer.Channel, NextTime);
+		}
+
+		// Last, a handler may send and open channels under ChannelInfo
+		if (bWritable) NotifyWritable(Shard, Timer.ClientID, Timer.Channel);
+	}
+}
+
+void URedNetworkServer::SendHeartbeat(FShard& Shard)
+{
+	for (FConnectionInfo& Info : Shard.Connections.GetValues())
+	{
+		if (Shard.NowTime - Info.Heartbeat < Heartbeat) continue;
+
+		Info.Heartbeat = Shard.NowTime;
+
+		Shard.SendBuffer.SetNumUninitialized(8, false);
+
+		Info.Pass.ToBytes(Shard.SendBuffer.GetData());
+
+		Shard.Socket->SendTo(Shard.SendBuffer.GetData(), Shard.SendBuffer.Num(), *Info.Addr);
+	}
+}
+
+void URedNetworkServer::HandleSocketRecv(FShard& Shard)
+{
+	check(Shard.Socket);
+
+	while (Shard.Socket->RecvBatch(Shard.Datagrams) > 0)
+	{
+		for (const FRedNetworkDatagram& Datagram : Shard.Datagrams)
+		{
+			if (Datagram.Count < 8) continue;
+
+			FRedNetworkPass SourcePass;
+			SourcePass.FromBytes(Datagram.Data);
+
+			// A redirected client may hash onto another socket, hand it back to the shard that issued its pass
+			FShard& OwnerShard = SourcePass.IsValid() ? GetShard(SourcePass.ID) : Shard;
+
+			if (&OwnerShard != &Shard)
+			{
+				OwnerShard.ForwardedPackets.Enqueue({ Datagram.Endpoint, TArray<uint8>(Datagram.Data, Datagram.Count) });
+				OwnerShard.Socket->Wake();
+				continue;
+			}
+
+			HandlePacket(Shard, Datagram);
+		}
+	}
+}
+
+void URedNetworkServer::HandlePacket(FShard& Shard, const FRedNetworkDatagram& Datagram)
+{
+	FRedNetworkPass SourcePass;
+	SourcePass.FromBytes(Datagram.Data);
+
+	if (!SourcePass.IsValid())
+	{
+		SendReadyPass(Shard, Datagram);
+		return;
+	}
+
+	FConnectionInfo* Info = nullptr;
+
+	// Datagrams the client sent before it learned its real ID still reach the connection
+	if (SourcePass.ID < 0)
+	{
+		const int32* ClientID = Shard.ReadyIDs.Find(SourcePass.ID);
+
+		if (ClientID) Info = FindConnection(Shard, *ClientID);
+	}
+	else
+	{
+		Info = FindConnection(Shard, SourcePass.ID);
+	}
+
+	// Established connections never touch the handshake table
+	if (Info && Info->Pass.Key == SourcePass.Key)
+	{
+		if (Info->ReadyID != 0 && SourcePass.ID == Info->Pass.ID)
+		{
+			Shard.ReadyIDs.Remove(Info->ReadyID);
+			Info->ReadyID = 0;
+		}
+
+		RedirectConnection(*Info, Datagram);
+	}
+	else
+	{
+		Info = RegisterConnection(Shard, SourcePass, Datagram);
+	}
+
+	if (!Info) return;
+
+	Info->RecvTime = Shard.NowTime;
+
+	// The confirming datagram still carries the provisional ID of the ready pass
+	const int32 ClientID = Info->Pass.ID;
+
+	FRedNetworkRecord Record;
+	int32 Offset = 8;
+
+	while (Record.Read(Datagram.Data, Datagram.Count, Offset))
+	{
+		if (IsUnreliableChannel(Record.Channel))
+		{
+			HandleUnreliableRecv(Shard, ClientID, Record);
+			continue;
+		}
+
+		FChannelInfo& ChannelInfo = EnsureChannelCreated(Shard, ClientID, Record.Channel);
+		FKCPWrap& KCPUnit = *ChannelInfo.KCPUnit;
+
+		if (ChannelInfo.FEC)
+		{
+			ChannelInfo.FEC->Decode(Record.Data, Record.Count, [&KCPUnit](const uint8* Data, int32 Count)
+			{
+				KCPUnit.Input(Data, Count);
+			});
+		}
+		else
+		{
+			KCPUnit.Input(Record.Data, Record.Count);
+		}
+
+		ScheduleKCP(Shard, ClientID, Record.Channel, Shard.KCPClock);
 	}
 }
 
-void URedNetworkServer::SendReadyPass(const TSharedRef<FInternetAddr>& SourceAddr)
+void URedNetworkServer::SendReadyPass(FShard& Shard, const FRedNetworkDatagram& Datagram)
 {
-	FString SourceAddrStr = SourceAddr->ToString(true);
+	FReadyInfo* ReadyInfo = Shard.ReadyPass.Find(Datagram.Endpoint);
 
-	if (!ReadyPass.Contains(SourceAddrStr))
+	if (!ReadyInfo)
 	{
 		FReadyInfo NewReadyPass;
-		NewReadyPass.Time = NowTime;
-		NewReadyPass.Pass.ID = NextReadyID++;
+		NewReadyPass.Time = Shard.NowTime;
+		NewReadyPass.Pass.ID = MakeReadyID(Shard);
 		NewReadyPass.Pass.RandKey();
+		NewReadyPass.Addr = Datagram.Endpoint.ToInternetAddr();
 
-		ReadyPass.Add(SourceAddrStr, NewReadyPass);
+		ReadyInfo = &Shard.ReadyPass.Add(Datagram.Endpoint, NewReadyPass);
 
-		UE_LOG(LogRedNetwork, Log, TEXT("Ready pass %i from %s."), NewReadyPass.Pass.ID, *SourceAddrStr);
+		UE_LOG(LogRedNetwork, Log, TEXT("Ready pass %i from %s."), NewReadyPass.Pass.ID, *Datagram.Endpoint.ToString());
 	}
 
-	const FRedNetworkPass& Pass = ReadyPass[SourceAddrStr].Pass;
+	const FRedNetworkPass& Pass = ReadyInfo->Pass;
 
-	SendBuffer.SetNum(8, false);
+	Shard.SendBuffer.SetNum(8, false);
 
-	Pass.ToBytes(SendBuffer.GetData());
+	Pass.ToBytes(Shard.SendBuffer.GetData());
 
-	int32 BytesSend;
-	SocketPtr->SendTo(SendBuffer.GetData(), SendBuffer.Num(), BytesSend, *SourceAddr);
+	Shard.Socket->SendTo(Shard.SendBuffer.GetData(), Shard.SendBuffer.Num(), *ReadyInfo->Addr);
 
-	UE_LOG(LogRedNetwork, Log, TEXT("Send ready pass %i to %s."), Pass.ID, *SourceAddrStr);
+	UE_LOG(LogRedNetwork, Verbose, TEXT("Send ready pass %i to %s."), Pass.ID, *Datagram.Endpoint.ToString());
 }
 
-void URedNetworkServer::RedirectConnection(const FRedNetworkPass& SourcePass, const TSharedRef<FInternetAddr>& SourceAddr)
+void URedNetworkServer::RedirectConnection(FConnectionInfo& Info, const FRedNetworkDatagram& Datagram)
 {
-	if (!Connections.Contains(SourcePass.ID) || Connections[SourcePass.ID].Pass.Key != SourcePass.Key) return;
-
-	if (!(*Connections[SourcePass.ID].Addr == *SourceAddr))
+	if (Info.Endpoint != Datagram.Endpoint)
 	{
-		UE_LOG(LogRedNetwork, Log, TEXT("Redirect connection %i from %s to %s."), SourcePass.ID, *Connections[SourcePass.ID].Addr->ToString(true), *SourceAddr->ToString(true));
+		UE_LOG(LogRedNetwork, Log, TEXT("Redirect connection %i from %s to %s."), Info.Pass.ID, *Info.Endpoint.ToString(), *Datagram.Endpoint.ToString());
 
-		Connections[SourcePass.ID].Addr = SourceAddr;
+		Info.Addr = Datagram.Endpoint.ToInternetAddr();
+		Info.Endpoint = Datagram.Endpoint;
 	}
 }
 
-void URedNetworkServer::RegisterConnection(const FRedNetworkPass& SourcePass, const TSharedRef<FInternetAddr>& SourceAddr)
+URedNetworkServer::FConnectionInfo* URedNetworkServer::RegisterConnection(FShard& Shard, const FRedNetworkPass& SourcePass, const FRedNetworkDatagram& Datagram)
 {
-	FString SourceAddrStr = SourceAddr->ToString(true);
+	const FReadyInfo* ReadyInfo = Shard.ReadyPass.Find(Datagram.Endpoint);
+
+	if (!ReadyInfo) return nullptr;
+	if (ReadyInfo->Pass.ID != SourcePass.ID || ReadyInfo->Pass.Key != SourcePass.Key) return nullptr;
 
-	if (!ReadyPass.Contains(SourceAddrStr)) return;
-	if (ReadyPass[SourceAddrStr].Pass.ID != SourcePass.ID || ReadyPass[SourceAddrStr].Pass.Key != SourcePass.Key) return;
+	// Only a client that echoed its key takes a slot, spoofed handshakes never get this far
+	uint32 Generation;
+	const int32 SlotIndex = Shard.Connections.Reserve(Generation);
+
+	if (SlotIndex == INDEX_NONE)
+	{
+		UE_LOG(LogRedNetwork, Warning, TEXT("Connection slots of shard %i are exhausted, drop connection from %s."), Shard.Index, *Datagram.Endpoint.ToString());
+		Shard.ReadyPass.Remove(Datagram.Endpoint);
+		return nullptr;
+	}
 
 	FConnectionInfo NewConnections;
-	NewConnections.Pass = SourcePass;
-	NewConnections.RecvTime = NowTime;
+	NewConnections.Pass.ID = MakeClientID(Shard, SlotIndex, Generation);
+	NewConnections.Pass.Key = SourcePass.Key;
+	NewConnections.ReadyID = SourcePass.ID;
+	NewConnections.RecvTime = Shard.NowTime;
 	NewConnections.Heartbeat = FDateTime::MinValue();
-	NewConnections.Addr = SourceAddr;
+	NewConnections.Addr = ReadyInfo->Addr;
+	NewConnections.Endpoint = Datagram.Endpoint;
+	NewConnections.Output.Pass = NewConnections.Pass;
+	NewConnections.Output.bPacing = IsPacingEnabled();
+	NewConnections.Output.SharedPacer = &Shard.Pacer;
+	NewConnections.Output.BufferPool = Shard.BufferPool.Get();
+	NewConnections.Output.Server = this;
+	NewConnections.Output.Shard = &Shard;
 
-	NewConnections.KCPUnits.SetNum(256);
+	FConnectionInfo* Info = Shard.Connections.Emplace(SlotIndex, Generation, MoveTemp(NewConnections));
 
-	Connections.Add(SourcePass.ID, NewConnections);
+	Shard.ReadyPass.Remove(Datagram.Endpoint);
 
-	ReadyPass.Remove(SourceAddrStr);
+	if (!Info) return nullptr;
 
-	UE_LOG(LogRedNetwork, Log, TEXT("Register connection %i."), SourcePass.ID);
+	Shard.ReadyIDs.Add(SourcePass.ID, Info->Pass.ID);
 
-	OnLogin.Broadcast(SourcePass.ID);
+	UE_LOG(LogRedNetwork, Log, TEXT("Register connection %i for ready pass %i."), Info->Pass.ID, SourcePass.ID);
+
+	NotifyLogin(Shard, Info->Pass.ID);
+
+	return Info;
 }
 
-void URedNetworkServer::HandleKCPRecv()
+void URedNetworkServer::HandleKCPRecv(FShard& Shard)
 {
-	for (auto Info : Connections)
+	for (const FConnectionInfo& Info : Shard.Connections.GetValues())
 	{
-		for (int32 Channel = 0; Channel < Info.Value.KCPUnits.Num(); ++Channel)
+		// Index and copy the unit, a receive handler may open another channel and shift the entries
+		for (int32 Index = 0; Index < Info.Channels.Num(); ++Index)
 		{
-			const TSharedPtr<FKCPWrap>& KCPUnit = Info.Value.KCPUnits[Channel];
+			const uint8 Channel = Info.Channels[Index].Channel;
+			const TSharedPtr<FKCPWrap> KCPUnit = Info.Channels[Index].Value.KCPUnit;
 
 			while (KCPUnit)
 			{
@@ -192,96 +832,370 @@ void URedNetworkServer::HandleKCPRecv()
 
 				if (Size < 0) break;
 
-				RecvBuffer.SetNumUninitialized(Size, false);
+				if (bPollMessages)
+				{
+					// Left in KCP until the game polls, the receive window fills and the client stops sending
+					if (!CanHoldMessage(Shard, Size)) break;
+
+					uint8* Dest = Shard.PendingMessages.Add(Info.Pass.ID, Channel, Size);
+
+					if (KCPUnit->Recv(Dest, Size) < 0)
+					{
+						Shard.PendingMessages.Pop();
+						break;
+					}
 
-				Size = KCPUnit->Recv(RecvBuffer.GetData(), RecvBuffer.Num());
+					continue;
+				}
+
+				FRedNetworkMessage Message = Shard.BufferPool->Acquire(Size);
+
+				Size = KCPUnit->Recv(Message->Data.GetData(), Message->Data.Num());
 
 				if (Size < 0) break;
 
-				RecvBuffer.SetNumUninitialized(Size, false);
+				Message->Data.SetNumUninitialized(Size, false);
 
-				OnRecv.Broadcast(Info.Key, Channel, RecvBuffer);
+				NotifyRecv(Shard, Info.Pass.ID, Channel, Message);
 			}
+
+			// Draining a full receive queue reopens the window, the peer is told on the next flush
+			if (KCPUnit && KCPUnit->GetKCPCB().probe) ScheduleKCP(Shard, Info.Pass.ID, Channel, Shard.KCPClock);
 		}
 	}
 }
 
-void URedNetworkServer::HandleExpiredReadyPass()
+void URedNetworkServer::HandleUnreliableRecv(FShard& Shard, int32 ClientID, const FRedNetworkRecord& Record)
 {
-	TArray<FString> ReadyPassAddr;
-	ReadyPass.GetKeys(ReadyPassAddr);
+	const uint8* Data = Record.Data;
+	int32 Count = Record.Count;
+
+	if (bPollMessages && !CanHoldMessage(Shard, Count)) return;
 
-	for (const FString& Addr : ReadyPassAddr)
+	if (IsSequencedChannel(Record.Channel))
 	{
-		if (NowTime - ReadyPass[Addr].Time > TimeoutLimit)
+		FConnectionInfo* Info = FindConnection(Shard, ClientID);
+
+		if (!Info || Count < FRedNetworkSequence::HeaderSize) return;
+
+		// Late or duplicated, a newer message has already been delivered
+		if (!Info->Sequences.FindOrAdd(Record.Channel).Accept(Data)) return;
+
+		Data += FRedNetworkSequence::HeaderSize;
+		Count -= FRedNetworkSequence::HeaderSize;
+	}
+
+	if (bPollMessages)
+	{
+		FMemory::Memcpy(Shard.PendingMessages.Add(ClientID, Record.Channel, Count), Data, Count);
+		return;
+	}
+
+	FRedNetworkMessage Message = Shard.BufferPool->Acquire(Count);
+
+	FMemory::Memcpy(Message->Data.GetData(), Data, Count);
+
+	NotifyRecv(Shard, ClientID, Record.Channel, Message);
+}
+
+bool URedNetworkServer::CanHoldMessage(const FShard& Shard, int32 Count) const
+{
+	const int64 Held = Shard.PendingMessages.Arena.Num() + Shard.QueuedMessageBytes.Load(EMemoryOrder::Relaxed);
+
+	return Held == 0 || Held + Count <= MaxPolledBytes;
+}
+
+void URedNetworkServer::HandleExpiredReadyPass(FShard& Shard)
+{
+	for (auto It = Shard.ReadyPass.CreateIterator(); It; ++It)
+	{
+		if (Shard.NowTime - It.Value().Time > TimeoutLimit)
 		{
-			UE_LOG(LogRedNetwork, Log, TEXT("Ready pass %i timeout."), ReadyPass[Addr].Pass.ID);
+			UE_LOG(LogRedNetwork, Log, TEXT("Ready pass %i timeout."), It.Value().Pass.ID);
 
-			ReadyPass.Remove(Addr);
+			It.RemoveCurrent();
 		}
 	}
 }
 
-void URedNetworkServer::HandleExpiredConnection()
+void URedNetworkServer::HandleExpiredConnection(FShard& Shard)
 {
-	TArray<int32> ConnectionsAddr;
-	Connections.GetKeys(ConnectionsAddr);
+	TArray<FConnectionInfo>& Connections = Shard.Connections.GetValues();
 
-	for (int32 ID : ConnectionsAddr)
+	// Walk backwards, a release swaps the last connection into the hole which has already been visited
+	for (int32 Index = Connections.Num() - 1; Index >= 0; --Index)
 	{
-		if (NowTime - Connections[ID].RecvTime > TimeoutLimit)
+		if (Shard.NowTime - Connections[Index].RecvTime > TimeoutLimit)
 		{
-			UE_LOG(LogRedNetwork, Log, TEXT("Connections connection %i timeout."), Connections[ID].Pass.ID);
+			const int32 ID = Connections[Index].Pass.ID;
 
-			Connections.Remove(ID);
+			UE_LOG(LogRedNetwork, Log, TEXT("Connections connection %i timeout."), ID);
+
+			for (const auto& Channel : Connections[Index].Channels)
+			{
+				if (Channel.Value.PublishedWaitSent != 0) Shard.WaitSentUpdates.Add({ MakeChannelKey(ID, Channel.Channel), 0 });
+			}
 
-			OnUnlogin.Broadcast(ID);
+			if (Connections[Index].ReadyID != 0) Shard.ReadyIDs.Remove(Connections[Index].ReadyID);
+
+			ReleaseClientID(Shard, ID);
+
+			NotifyUnlogin(Shard, ID);
 		}
 	}
 }
 
-void URedNetworkServer::EnsureChannelCreated(int32 ClientID, uint8 Channel)
+URedNetworkServer::FChannelInfo& URedNetworkServer::EnsureChannelCreated(FShard& Shard, int32 ClientID, uint8 Channel)
 {
-	FConnectionInfo& Info = Connections[ClientID];
+	FChannelInfo& ChannelInfo = FindConnection(Shard, ClientID)->Channels.FindOrAdd(Channel);
 
-	if (Info.KCPUnits[Channel]) return;
+	if (ChannelInfo.KCPUnit) return ChannelInfo;
+
+	const FRedNetworkChannelConfig& Config = GetChannelConfig(Channel);
 
 	TSharedPtr<FKCPWrap> KCPUnit = MakeShared<FKCPWrap>(0, FString::Printf(TEXT("Server-%i:%i"), ClientID, Channel));
-	KCPUnit->SetTurboMode();
+	KCPUnit->SetReserved(Config.GetReservedSize());
+	Config.Apply(*KCPUnit);
 	KCPUnit->GetKCPCB().logmask = KCPLogMask;
 
-	KCPUnit->OutputFunc = [this, ClientID, Channel](const uint8* Data, int32 Count)->int32
-	{
-		const FConnectionInfo& Info = Connections[ClientID];
+	TSharedPtr<FRedNetworkFEC> FEC = Config.CreateFEC();
 
-		SendBuffer.SetNumUninitialized(9, false);
+	FShard* ShardPtr = &Shard;
 
-		Info.Pass.ToBytes(SendBuffer.GetData());
-
-		SendBuffer[8] = Channel;
+	KCPUnit->OutputFunc = [this, ShardPtr, ClientID, Channel, FEC](uint8* Packet, int32 Count)->int32
+	{
+		FConnectionOutput& Output = FindConnection(*ShardPtr, ClientID)->Output;
 
-		if (Count != 0) SendBuffer.Append(Data, Count);
+		if (!FEC)
+		{
+			Output.Queue(Channel, Packet, Count);
+			return 0;
+		}
 
-		int32 BytesSend;
-		SocketPtr->SendTo(SendBuffer.GetData(), SendBuffer.Num(), BytesSend, *Info.Addr);
+		FEC->Encode(Packet, Count, ShardPtr->KCPClock, [&Output, Channel](uint8* FECPacket, int32 FECCount)
+		{
+			Output.Queue(Channel, FECPacket, FECCount);
+		});
 
 		return 0;
 	};
 
-	Info.KCPUnits[Channel] = KCPUnit;
+	ChannelInfo.KCPUnit = KCPUnit;
+	ChannelInfo.FEC = FEC;
+
+	return ChannelInfo;
+}
+
+int32 URedNetworkServer::SendUnreliable(FShard& Shard, TArrayView<const int32> ClientIDs, uint8 Channel, const uint8* Data, int32 Count)
+{
+	const int32 SequenceSize = IsSequencedChannel(Channel) ? FRedNetworkSequence::HeaderSize : 0;
+
+	// A single client shares the datagram its other channels are filling
+	if (ClientIDs.Num() == 1)
+	{
+		FConnectionInfo* Info = FindConnection(Shard, ClientIDs[0]);
+
+		if (!Info) return 0;
+
+		uint8* Dest = Info->Output.Append(Channel, SequenceSize + Count);
+
+		if (SequenceSize != 0) Info->Sequences.FindOrAdd(Channel).WriteNext(Dest);
+
+		FMemory::Memcpy(Dest + SequenceSize, Data, Count);
+
+		return 1;
+	}
+
+	// Frame the record once, only the leading pass and the sequence differ between clients
+	Shard.SendBuffer.SetNumUninitialized(FRedNetworkRecord::FrameSize + SequenceSize + Count, false);
+
+	uint8* Frame = Shard.SendBuffer.GetData();
+
+	FRedNetworkRecord::WriteHeader(Frame + 8, Channel, SequenceSize + Count);
+	FMemory::Memcpy(Frame + FRedNetworkRecord::FrameSize + SequenceSize, Data, Count);
+
+	int32 NumSent = 0;
+
+	for (int32 ClientID : ClientIDs)
+	{
+		FConnectionInfo* Info = FindConnection(Shard, ClientID);
+
+		if (!Info) continue;
+
+		Info->Pass.ToBytes(Frame);
+
+		if (SequenceSize != 0) Info->Sequences.FindOrAdd(Channel).WriteNext(Frame + FRedNetworkRecord::FrameSize);
+
+		Info->Output.SendDatagram(Frame, Shard.SendBuffer.Num());
+
+		++NumSent;
+	}
+
+	return NumSent;
+}
+
+void URedNetworkServer::FConnectionOutput::SendTo(const uint8* Data, int32 Count)
+{
+	FConnectionInfo& Info = *Server->FindConnection(*Shard, Pass.ID);
+
+	// Any datagram keeps the client alive, no need for a separate heartbeat
+	Info.Heartbeat = Shard->NowTime;
+
+	Shard->Socket->SendTo(Data, Count, *Info.Addr);
+}
+
+void URedNetworkServer::FConnectionOutput::RefillPacing()
+{
+	// Once per tick, the KCP clock does not move within one
+	if (Shard->PacingTick != Shard->TickCount)
+	{
+		Shard->PacingTick = Shard->TickCount;
+		Shard->Pacer.Refill(Shard->KCPClock, Server->ServerPacingRate / Server->Shards.Num(), Server->PacingBurst);
+	}
+
+	if (PacingTick != Shard->TickCount)
+	{
+		PacingTick = Shard->TickCount;
+		Pacer.Refill(Shard->KCPClock, Server->GetConnectionPacingRate(*Server->FindConnection(*Shard, Pass.ID)), Server->PacingBurst);
+	}
+}
+
+void URedNetworkServer::FConnectionOutput::OnPending()
+{
+	Shard->PendingConnections.Add(Pass.ID);
+
+	// Flushed before the tick ends, the heartbeat of this tick can be skipped already
+	Server->FindConnection(*Shard, Pass.ID)->Heartbeat = Shard->NowTime;
+}
+
+void URedNetworkServer::FConnectionOutput::OnPaced()
+{
+	Shard->PacedConnections.Add(Pass.ID);
+}
+
+void URedNetworkServer::SendPacedDatagrams(FShard& Shard)
+{
+	for (int32 Index = 0; Index < Shard.PacedConnections.Num();)
+	{
+		FConnectionInfo* Info = FindConnection(Shard, Shard.PacedConnections[Index]);
+
+		if (Info && Info->Output.SendPacedDatagrams()) ++Index;
+		else Shard.PacedConnections.RemoveAtSwap(Index, 1, false);
+	}
+}
+
+int64 URedNetworkServer::GetConnectionPacingRate(FConnectionInfo& Info) const
+{
+	if (!bEstimatePacingRate) return ConnectionPacingRate;
+
+	int64 Estimate = 0;
+
+	for (auto& Channel : Info.Channels)
+	{
+		if (Channel.Value.KCPUnit) Estimate += FRedNetworkPacer::EstimateRate(*Channel.Value.KCPUnit);
+	}
+
+	return FRedNetworkPacer::CapRate(ConnectionPacingRate, Estimate);
+}
+
+void URedNetworkServer::FlushPendingOutputs(FShard& Shard)
+{
+	for (int32 ClientID : Shard.PendingConnections)
+	{
+		FConnectionInfo* Info = FindConnection(Shard, ClientID);
+
+		if (Info) Info->Output.Flush();
+	}
+
+	Shard.PendingConnections.Reset();
+}
+
+bool URedNetworkServer::SendKCP(FShard& Shard, int32 ClientID, uint8 Channel, const uint8* Data, int32 Count, uint32 Time, bool bMayRefuse)
+{
+	FChannelInfo& ChannelInfo = EnsureChannelCreated(Shard, ClientID, Channel);
+
+	bool bOverflowed;
+	const bool bAdmitted = GetChannelConfig(Channel).Admit(*ChannelInfo.KCPUnit, Count, bOverflowed, bMayRefuse);
+
+	if (bOverflowed) ChannelInfo.bBlocked = true;
+
+	if (!bAdmitted || ChannelInfo.KCPUnit->Send(Data, Count) != 0) return false;
+
+	ScheduleKCP(Shard, ClientID, Channel, Time);
+
+	return true;
+}
+
+void URedNetworkServer::ScheduleKCP(FShard& Shard, int32 ClientID, uint8 Channel, uint32 Time)
+{
+	FChannelInfo& ChannelInfo = *FindConnection(Shard, ClientID)->Channels.Find(Channel);
+
+	if (ChannelInfo.bScheduled && (int32)(ChannelInfo.UpdateTime - Time) <= 0) return;
+
+	ChannelInfo.UpdateTime = Time;
+	ChannelInfo.bScheduled = true;
+
+	Shard.KCPTimers.HeapPush({ Time, ClientID, Channel });
+}
+
+bool URedNetworkServer::CreateShardSocket(FShard& Shard)
+{
+	Shard.Socket = FRedNetworkSocket::Create(SocketBackend, FString::Printf(TEXT("Red Server Socket %i"), Shard.Index));
+
+	// Every shard after the first joins the port the first one actually bound
+	if (!Shard.Socket->Open(Shard.Index == 0 ? Port : Shards[0]->Socket->GetPortNo(), Shards.Num() > 1))
+	{
+		Shard.Socket = nullptr;
+		return false;
+	}
+
+	return true;
+}
+
+void URedNetworkServer::StartShardThread(FShard& Shard)
+{
+	FShard* ShardPtr = &Shard;
+
+	Shard.Runnable = MakeShared<FRedNetworkRunnable>([this, ShardPtr]()
+	{
+		TickNetwork(*ShardPtr);
+		WaitNetwork(*ShardPtr);
+	});
+
+	Shard.Thread = FRunnableThread::Create(Shard.Runnable.Get(), *FString::Printf(TEXT("RedNetworkServer%i"), Shard.Index), 0, TPri_AboveNormal);
+
+	if (Shard.Thread == nullptr)
+	{
+		UE_LOG(LogRedNetwork, Warning, TEXT("Network thread %i creation failed, fall back to game thread."), Shard.Index);
+		Shard.Runnable = nullptr;
+	}
+}
+
+void URedNetworkServer::StopShardThread(FShard& Shard)
+{
+	if (!Shard.Thread) return;
+
+	Shard.Runnable->Stop();
+	Shard.Socket->Wake();
+
+	Shard.Thread->Kill(true);
+	delete Shard.Thread;
+	Shard.Thread = nullptr;
+	Shard.Runnable = nullptr;
+
+	Shard.SendRequests.Empty();
 }
 
 void URedNetworkServer::Tick(float DeltaTime)
 {
 	if (!IsActive()) return;
-	NowTime = FDateTime::Now();
 
-	UpdateKCP();
-	SendHeartbeat();
-	HandleSocketRecv();
-	HandleKCPRecv();
-	HandleExpiredReadyPass();
-	HandleExpiredConnection();
+	HandleNetworkEvents();
+
+	for (const TUniquePtr<FShard>& Shard : Shards)
+	{
+		if (!Shard->Runnable) TickNetwork(*Shard);
+	}
 }
 
 void URedNetworkServer::Activate(bool bReset)
@@ -297,61 +1211,66 @@ void URedNetworkServer::Activate(bool bReset)
 		return;
 	}
 
-	SocketPtr = SocketSubsystem->CreateSocket(NAME_DGram, TEXT("Red Server Socket"));
+	ChannelSettings = { UnreliableChannels, SequencedChannels, ChannelConfigs, DefaultChannelConfig };
 
-	if (SocketPtr == nullptr)
+	for (int32 Index = 0; Index < FMath::Max(NumShards, 1); ++Index)
 	{
-		UE_LOG(LogRedNetwork, Error, TEXT("Socket creation failed."));
-		return;
+		TUniquePtr<FShard> Shard = MakeUnique<FShard>();
+		Shard->Index = Index;
+		Shard->BufferPool = MakeShared<FRedNetworkBufferPool, ESPMode::ThreadSafe>();
+		Shards.Add(MoveTemp(Shard));
 	}
 
-	TSharedRef<FInternetAddr> ServerAddr = SocketSubsystem->CreateInternetAddr();
-
-	ServerAddr->SetAnyAddress();
-	ServerAddr->SetPort(Port);
+	// Generations take whatever bits are left once the largest ID, the last slot of the last shard, fits in a positive int32
+	const uint32 MaxLocalID = ((uint32)MAX_int32 - (uint32)(Shards.Num() - 1)) / (uint32)Shards.Num();
+	const uint32 MaxGeneration = FMath::Max<uint32>((MaxLocalID + 1) >> SlotIndexBits, 1) - 1;
 
-	if (!SocketPtr->Bind(*ServerAddr))
+	for (const TUniquePtr<FShard>& Shard : Shards)
 	{
-		UE_LOG(LogRedNetwork, Error, TEXT("Socket bind failed."));
-		SocketSubsystem->DestroySocket(SocketPtr);
-		return;
+		Shard->Connections.SetLimits(1 << SlotIndexBits, MaxGeneration);
 	}
 
-	if (!SocketPtr->SetNonBlocking())
+	for (const TUniquePtr<FShard>& Shard : Shards)
 	{
-		UE_LOG(LogRedNetwork, Error, TEXT("Socket set non-blocking failed."));
-		SocketSubsystem->DestroySocket(SocketPtr);
+		if (CreateShardSocket(*Shard)) continue;
+
+		Shards.Reset();
 		return;
 	}
 
-	NextReadyID = 1;
-
 	UE_LOG(LogRedNetwork, Log, TEXT("Red Network Server activate."));
 
 	bIsActive = true;
+
+	if (bUseNetworkThread || Shards.Num() > 1)
+	{
+		for (const TUniquePtr<FShard>& Shard : Shards)
+		{
+			StartShardThread(*Shard);
+		}
+	}
 }
 
 void URedNetworkServer::Deactivate()
 {
 	if (!bIsActive) return;
 
-	TArray<int32> ConnectionsAddr;
-	Connections.GetKeys(ConnectionsAddr);
-
-	for (int32 ID : ConnectionsAddr)
+	for (const TUniquePtr<FShard>& Shard : Shards)
 	{
-		OnUnlogin.Broadcast(ID);
+		StopShardThread(*Shard);
 	}
 
-	ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get();
-	check(SocketSubsystem);
-	SocketSubsystem->DestroySocket(SocketPtr);
+	HandleNetworkEvents();
 
-	SendBuffer.SetNum(0);
-	RecvBuffer.SetNum(0);
+	for (const TUniquePtr<FShard>& Shard : Shards)
+	{
+		for (const FConnectionInfo& Info : Shard->Connections.GetValues())
+		{
+			OnUnlogin.Broadcast(Info.Pass.ID);
+		}
+	}
 
-	ReadyPass.Reset();
-	Connections.Reset();
+	Shards.Reset();
 
 	UE_LOG(LogRedNetwork, Log, TEXT("Red Network Server deactivate."));
 
@@ -0,0 +1,129 @@
+#include "RedNetworkSocket.h"
+
+#include "Logging.h"
+#include "Sockets.h"
+#include "IPAddress.h"
+#include "SocketSubsystem.h"
+#include "RedNetworkLinuxSocket.h"
+#include "RedNetworkUringSocket.h"
+
+TSharedPtr<FRedNetworkSocket> FRedNetworkSocket::Create(ERedNetworkSocketBackend Backend, const FString& Description)
+{
+#if RED_NETWORK_WITH_IO_URING
+	if (Backend == ERedNetworkSocketBackend::IoUring) return MakeShared<FRedNetworkUringSocket>();
+#endif
+
+#if PLATFORM_LINUX
+	if (Backend != ERedNetworkSocketBackend::Generic) return MakeShared<FRedNetworkLinuxSocket>();
+#endif
+
+	return MakeShared<FRedNetworkGenericSocket>(Description);
+}
+
+FRedNetworkGenericSocket::FRedNetworkGenericSocket(const FString& InDescription)
+	: Description(InDescription)
+{
+}
+
+FRedNetworkGenericSocket::~FRedNetworkGenericSocket()
+{
+	Close();
+}
+
+bool FRedNetworkGenericSocket::Open(int32 Port, bool bReusePort)
+{
+	ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get();
+	check(SocketSubsystem);
+
+	SocketPtr = SocketSubsystem->CreateSocket(NAME_DGram, Description);
+
+	if (SocketPtr == nullptr)
+	{
+		UE_LOG(LogRedNetwork, Error, TEXT("Socket creation failed."));
+		return false;
+	}
+
+	// On BSD sockets this also sets SO_REUSEPORT
+	if (bReusePort && !SocketPtr->SetReuseAddr(true))
+	{
+		UE_LOG(LogRedNetwork, Error, TEXT("Socket set reuse addr failed."));
+		Close();
+		return false;
+	}
+
+	TSharedRef<FInternetAddr> BindAddr = SocketSubsystem->CreateInternetAddr();
+
+	BindAddr->SetAnyAddress();
+	BindAddr->SetPort(Port);
+
+	if (!SocketPtr->Bind(*BindAddr))
+	{
+		UE_LOG(LogRedNetwork, Error, TEXT("Socket bind failed."));
+		Close();
+		return false;
+	}
+
+	if (!SocketPtr->SetNonBlocking())
+	{
+		UE_LOG(LogRedNetwork, Error, TEXT("Socket set non-blocking failed."));
+		Close();
+		return false;
+	}
+
+	SourceAddr = SocketSubsystem->CreateInternetAddr();
+
+	RecvBuffer.SetNumUninitialized(65535);
+
+	return true;
+}
+
+int32 FRedNetworkGenericSocket::GetPortNo() const
+{
+	return SocketPtr ? SocketPtr->GetPortNo() : 0;
+}
+
+void FRedNetworkGenericSocket::GetAddress(FInternetAddr& OutAddr) const
+{
+	if (SocketPtr) SocketPtr->GetAddress(OutAddr);
+}
+
+int32 FRedNetworkGenericSocket::RecvBatch(TArray<FRedNetworkDatagram>& OutDatagrams)
+{
+	check(SocketPtr);
+	int32 BytesRead;
+
+	if (!SocketPtr->RecvFrom(RecvBuffer.GetData(), RecvBuffer.Num(), BytesRead, *SourceAddr)) return 0;
+
+	OutDatagrams.SetNum(1, false);
+	OutDatagrams[0].Data = RecvBuffer.GetData();
+	OutDatagrams[0].Count = BytesRead;
+	OutDatagrams[0].Endpoint = FRedNetworkEndpoint(*SourceAddr);
+
+	return 1;
+}
+
+void FRedNetworkGenericSocket::SendTo(const uint8* Data, int32 Count, const FInternetAddr& Addr)
+{
+	check(SocketPtr);
+
+	int32 BytesSend;
+	SocketPtr->SendTo(Data, Count, BytesSend, Addr);
+}
+
+void FRedNetworkGenericSocket::Wait(FTimespan Timeout)
+{
+	check(SocketPtr);
+
+	SocketPtr->Wait(ESocketWaitConditions::WaitForRead, Timeout);
+}
+
+void FRedNetworkGenericSocket::Close()
+{
+	if (!SocketPtr) return;
+
+	ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get();
+	check(SocketSubsystem);
+	SocketSubsystem->DestroySocket(SocketPtr);
+
+	SocketPtr = nullptr;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "RedNetworkType.h"
+
+class FSocket;
+class FInternetAddr;
+
+class FRedNetworkSocket
+{
+public:
+
+	static TSharedPtr<FRedNetworkSocket> Create(ERedNetworkSocketBackend Backend, const FString& Description);
+
+	virtual ~FRedNetworkSocket() { }
+
+	/** Create, bind to any address and set non-blocking. */
+	virtual bool Open(int32 Port, bool bReusePort) = 0;
+
+	virtual int32 GetPortNo() const = 0;
+
+	virtual void GetAddress(FInternetAddr& OutAddr) const = 0;
+
+	/** Received datagrams stay valid until the next call, returns 0 when nothing is pending. */
+	virtual int32 RecvBatch(TArray<FRedNetworkDatagram>& OutDatagrams) = 0;
+
+	/** May be queued until Flush. */
+	virtual void SendTo(const uint8* Data, int32 Count, const FInternetAddr& Addr) = 0;
+
+	virtual void Flush() { }
+
+	/** Block until a datagram is readable, Wake is called or the timeout passes. */
+	virtual void Wait(FTimespan Timeout) = 0;
+
+	/** Interrupt Wait from another thread, only if IsWakeable. */
+	virtual void Wake() { }
+
+	virtual bool IsWakeable() const { return false; }
+
+};
+
+class FRedNetworkGenericSocket : public FRedNetworkSocket
+{
+public:
+
+	FRedNetworkGenericSocket(const FString& InDescription);
+
+	virtual ~FRedNetworkGenericSocket() override;
+
+	//~ Begin FRedNetworkSocket Interface
+	virtual bool Open(int32 Port, bool bReusePort) override;
+	virtual int32 GetPortNo() const override;
+	virtual void GetAddress(FInternetAddr& OutAddr) const override;
+	virtual int32 RecvBatch(TArray<FRedNetworkDatagram>& OutDatagrams) override;
+	virtual void SendTo(const uint8* Data, int32 Count, const FInternetAddr& Addr) override;
+	virtual void Wait(FTimespan Timeout) override;
+	//~ End FRedNetworkSocket Interface
+
+private:
+
+	FString Description;
+
+	FSocket* SocketPtr = nullptr;
+
+	/** Reused by every RecvFrom, datagrams only carry the endpoint. */
+	TSharedPtr<FInternetAddr> SourceAddr;
+
+	TArray<uint8> RecvBuffer;
+
+	void Close();
+
+};
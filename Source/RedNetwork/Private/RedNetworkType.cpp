@@ -1,6 +1,12 @@
 #include "RedNetworkType.h"
 #include "..\Public\RedNetworkType.h"
 
+#include "RedNetworkFEC.h"
+#include "KCPWrap.h"
+#include "KCPCongestionControl.h"
+#include "IPAddress.h"
+#include "SocketSubsystem.h"
+
 FRedNetworkPass::FRedNetworkPass()
 	: ID(0)
 	, Key(0)
@@ -60,3 +66,285 @@ bool FRedNetworkPass::IsValid() const
 {
 	return ID;
 }
+
+void FRedNetworkRecord::WriteHeader(uint8* Dest, uint8 Channel, int32 Count)
+{
+	check(Count >= 0 && Count <= MAX_uint16);
+
+	Dest[0] = Channel;
+	Dest[1] = Count >> 0;
+	Dest[2] = Count >> 8;
+}
+
+uint8* FRedNetworkRecord::AppendUninitialized(TArray<uint8>& Buffer, uint8 Channel, int32 Count)
+{
+	const int32 Offset = Buffer.AddUninitialized(HeaderSize + Count);
+
+	uint8* Record = Buffer.GetData() + Offset;
+
+	WriteHeader(Record, Channel, Count);
+
+	return Record + HeaderSize;
+}
+
+bool FRedNetworkRecord::Read(const uint8* Datagram, int32 DatagramCount, int32& Offset)
+{
+	if (DatagramCount - Offset < HeaderSize) return false;
+
+	const uint8* Record = Datagram + Offset;
+
+	Channel = Record[0];
+	Count = (int32)Record[1] | (int32)Record[2] << 8;
+	Data = Record + HeaderSize;
+
+	if (DatagramCount - Offset - HeaderSize < Count) return false;
+
+	Offset += HeaderSize + Count;
+
+	return true;
+}
+
+void FRedNetworkSequence::WriteNext(uint8* Dest)
+{
+	Dest[0] = NextSend >> 0;
+	Dest[1] = NextSend >> 8;
+
+	++NextSend;
+}
+
+bool FRedNetworkSequence::Accept(const uint8* Data)
+{
+	const uint16 Sequence = (uint16)Data[0] | (uint16)Data[1] << 8;
+
+	// Compare modulo 2^16, anything within half the range behind the newest is stale
+	if (bHasRecv && (int16)(Sequence - LastRecv) <= 0) return false;
+
+	LastRecv = Sequence;
+	bHasRecv = true;
+
+	return true;
+}
+
+void FRedNetworkPacer::Refill(uint32 Now, int64 InRate, int64 Burst)
+{
+	Rate = InRate;
+
+	if (!bStarted)
+	{
+		bStarted = true;
+		Time = Now;
+		Tokens = Burst;
+		return;
+	}
+
+	const int64 Gained = Rate * FMath::Max((int32)(Now - Time), 0) / 1000;
+
+	// Keep the clock where it was until a whole token accrues, slow rates would never refill otherwise
+	if (Gained <= 0) return;
+
+	Time = Now;
+	Tokens = FMath::Min(Tokens + Gained, Burst);
+}
+
+int64 FRedNetworkPacer::EstimateRate(FKCPWrap& KCPUnit)
+{
+	const IKCPCongestionControl* Control = KCPUnit.GetCongestionControl();
+
+	if (Control && Control->GetPacingRate() > 0) return Control->GetPacingRate();
+
+	const ikcpcb& KCPCB = KCPUnit.GetKCPCB();
+
+	int64 Window = FMath::Min(KCPCB.snd_wnd, KCPCB.rmt_wnd);
+	if (!KCPCB.nocwnd || Control) Window = FMath::Min<int64>(Window, KCPCB.cwnd);
+
+	const int64 RTT = KCPCB.rx_srtt > 0 ? KCPCB.rx_srtt : 100;
+
+	return FMath::Max<int64>(Window, 1) * KCPCB.mss * 1000 * 5 / 4 / RTT;
+}
+
+int64 FRedNetworkPacer::CapRate(int64 Rate, int64 Estimate)
+{
+	if (Estimate <= 0) return Rate;
+
+	return Rate > 0 ? FMath::Min(Estimate, Rate) : Estimate;
+}
+
+void FRedNetworkMessageBatch::Reset()
+{
+	Arena.Reset();
+	Entries.Reset();
+}
+
+uint8* FRedNetworkMessageBatch::Add(int32 ClientID, uint8 Channel, int32 Count)
+{
+	const int32 Offset = Arena.AddUninitialized(Count);
+
+	Entries.Add({ ClientID, Channel, Offset, Count });
+
+	return Arena.GetData() + Offset;
+}
+
+void FRedNetworkMessageBatch::Pop()
+{
+	const FEntry Entry = Entries.Pop(false);
+
+	Arena.SetNumUninitialized(Entry.Offset, false);
+}
+
+void FRedNetworkMessageBatch::Append(FRedNetworkMessageBatch& Other)
+{
+	if (Entries.Num() == 0)
+	{
+		Swap(Arena, Other.Arena);
+		Swap(Entries, Other.Entries);
+		return;
+	}
+
+	const int32 Base = Arena.Num();
+
+	Arena.Append(Other.Arena);
+
+	for (const FEntry& Entry : Other.Entries)
+	{
+		Entries.Add({ Entry.ClientID, Entry.Channel, Base + Entry.Offset, Entry.Count });
+	}
+}
+
+FRedNetworkEndpoint::FRedNetworkEndpoint()
+	: Words{ 0, 0, 0, 0 }
+	, Port(0)
+{
+}
+
+FRedNetworkEndpoint::FRedNetworkEndpoint(const FInternetAddr& Addr)
+	: FRedNetworkEndpoint()
+{
+	Port = Addr.GetPort();
+
+	if (Addr.GetProtocolType() == FNetworkProtocolTypes::IPv6)
+	{
+		TArray<uint8> RawIp = Addr.GetRawIp();
+
+		if (RawIp.Num() != 16) return;
+
+		for (int32 Index = 0; Index < 4; ++Index)
+		{
+			Words[Index] |= (uint32)RawIp[Index * 4 + 0] << 24;
+			Words[Index] |= (uint32)RawIp[Index * 4 + 1] << 16;
+			Words[Index] |= (uint32)RawIp[Index * 4 + 2] << 8;
+			Words[Index] |= (uint32)RawIp[Index * 4 + 3] << 0;
+		}
+	}
+	else
+	{
+		uint32 Ip = 0;
+		Addr.GetIp(Ip);
+
+		*this = FromIPv4(Ip, Port);
+	}
+}
+
+FRedNetworkEndpoint FRedNetworkEndpoint::FromIPv4(uint32 Ip, uint16 Port)
+{
+	FRedNetworkEndpoint Endpoint;
+	Endpoint.Words[2] = 0x0000FFFF;
+	Endpoint.Words[3] = Ip;
+	Endpoint.Port = Port;
+	return Endpoint;
+}
+
+FString FRedNetworkEndpoint::ToString() const
+{
+	if (Words[0] == 0 && Words[1] == 0 && Words[2] == 0x0000FFFF)
+	{
+		return FString::Printf(TEXT("%u.%u.%u.%u:%u"), (Words[3] >> 24) & 0xFF, (Words[3] >> 16) & 0xFF, (Words[3] >> 8) & 0xFF, Words[3] & 0xFF, Port);
+	}
+
+	return FString::Printf(TEXT("[%x:%x:%x:%x:%x:%x:%x:%x]:%u"),
+		Words[0] >> 16, Words[0] & 0xFFFF, Words[1] >> 16, Words[1] & 0xFFFF,
+		Words[2] >> 16, Words[2] & 0xFFFF, Words[3] >> 16, Words[3] & 0xFFFF, Port);
+}
+
+TSharedRef<FInternetAddr> FRedNetworkEndpoint::ToInternetAddr() const
+{
+	ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get();
+	check(SocketSubsystem);
+
+	TSharedRef<FInternetAddr> Addr = SocketSubsystem->CreateInternetAddr();
+
+	if (Words[0] == 0 && Words[1] == 0 && Words[2] == 0x0000FFFF)
+	{
+		Addr->SetIp(Words[3]);
+	}
+	else
+	{
+		TArray<uint8> RawIp;
+		RawIp.SetNumUninitialized(16);
+
+		for (int32 Index = 0; Index < 4; ++Index)
+		{
+			RawIp[Index * 4 + 0] = Words[Index] >> 24;
+			RawIp[Index * 4 + 1] = Words[Index] >> 16;
+			RawIp[Index * 4 + 2] = Words[Index] >> 8;
+			RawIp[Index * 4 + 3] = Words[Index] >> 0;
+		}
+
+		Addr->SetRawIp(RawIp);
+	}
+
+	Addr->SetPort(Port);
+
+	return Addr;
+}
+
+int32 FRedNetworkChannelConfig::GetReservedSize() const
+{
+	return FRedNetworkRecord::FrameSize + (FECDataShards > 0 ? FRedNetworkFEC::ParityHeaderSize : 0);
+}
+
+TSharedPtr<FRedNetworkFEC> FRedNetworkChannelConfig::CreateFEC() const
+{
+	if (FECDataShards <= 0) return nullptr;
+
+	return MakeShared<FRedNetworkFEC>(FECDataShards, FECParityShards);
+}
+
+void FRedNetworkChannelConfig::Apply(FKCPWrap& KCPUnit) const
+{
+	KCPUnit.SetNoDelay(bNoDelay ? 1 : 0, Interval, FastResend, bNoCongestionWindow ? 1 : 0);
+	KCPUnit.SetWindowSize(SendWindow, RecvWindow);
+	KCPUnit.SetMTU(FMath::Clamp(MTU, 64, FRedNetworkRecord::MaxDatagramSize));
+
+	KCPUnit.GetKCPCB().stream = bStreamMode ? 1 : 0;
+
+	if (CongestionControl == ERedNetworkCongestionControl::BBR) KCPUnit.SetCongestionControl(MakeShared<FKCPBBRControl>());
+}
+
+bool FRedNetworkChannelConfig::Admit(FKCPWrap& KCPUnit, int32 Count, bool& bOutOverflowed, bool bMayRefuse) const
+{
+	bOutOverflowed = false;
+
+	if (MaxWaitSent <= 0) return true;
+
+	const int32 Segments = FMath::Max(1, FMath::DivideAndRoundUp(Count, (int32)KCPUnit.GetKCPCB().mss));
+	const int32 Excess = KCPUnit.GetWaitSent() + Segments - MaxWaitSent;
+
+	if (Excess < 0) return true;
+
+	// Filling the cap blocks as well, the writable notification must cover the send refused next
+	bOutOverflowed = true;
+
+	if (Excess == 0) return true;
+
+	if (OverflowPolicy == ERedNetworkOverflowPolicy::Reject) return !bMayRefuse;
+
+	KCPUnit.DropSendQueue(Excess);
+
+	// Segments in flight are never dropped and may still fill the cap on their own
+	return !bMayRefuse || KCPUnit.GetWaitSent() + Segments <= MaxWaitSent;
+}
+
+bool FRedNetworkChannelConfig::IsWritable(const FKCPWrap& KCPUnit) const
+{
+	return MaxWaitSent <= 0 || KCPUnit.GetWaitSent() <= MaxWaitSent / 2;
+}
@@ -0,0 +1,508 @@
+#include "RedNetworkUringSocket.h"
+
+#if RED_NETWORK_WITH_IO_URING
+
+#include "Logging.h"
+#include "IPAddress.h"
+#include "SocketSubsystem.h"
+
+THIRD_PARTY_INCLUDES_START
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+THIRD_PARTY_INCLUDES_END
+
+namespace
+{
+	constexpr uint64 RecvUserData = MAX_uint64;
+	constexpr uint64 CancelUserData = MAX_uint64 - 1;
+
+	constexpr uint16 RecvBufferGroup = 0;
+
+	/** recvmsg_out header, source address and payload share one provided buffer. */
+	constexpr int32 RecvBufferSize = sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in) + FRedNetworkLinuxSocket::RecvSlotSize;
+
+	int UringSetup(uint32 Entries, io_uring_params* Params)
+	{
+		return syscall(__NR_io_uring_setup, Entries, Params);
+	}
+
+	int UringEnter(int RingFd, uint32 ToSubmit, uint32 MinComplete, uint32 Flags)
+	{
+		return syscall(__NR_io_uring_enter, RingFd, ToSubmit, MinComplete, Flags, nullptr, 0);
+	}
+
+	int UringRegister(int RingFd, uint32 Opcode, void* Arg, uint32 NumArgs)
+	{
+		return syscall(__NR_io_uring_register, RingFd, Opcode, Arg, NumArgs);
+	}
+
+	// The C flexible array 'bufs' lands 8 bytes off when the header is compiled as C++, so index from the ring base
+	io_uring_buf* GetRingBuf(io_uring_buf_ring* Ring, uint32 Index)
+	{
+		return reinterpret_cast<io_uring_buf*>(Ring) + Index;
+	}
+}
+
+FRedNetworkUringSocket::FRedNetworkUringSocket()
+	: RingFd(-1)
+	, bRingSend(false)
+	, bRingRecv(false)
+	, bRecvArmed(false)
+	, SqRing(nullptr)
+	, CqRing(nullptr)
+	, Sqes(nullptr)
+	, BufRing(nullptr)
+	, BufRingTail(0)
+{
+	FMemory::Memzero(RecvHdr);
+	FMemory::Memzero(SendSlotInfos);
+
+	SendBuffers.SetNumUninitialized(NumSendSlots * SendSlotSize);
+
+	for (int32 Index = NumSendSlots - 1; Index >= 0; --Index)
+	{
+		FSendSlot& Slot = SendSlotInfos[Index];
+		Slot.Iovec.iov_base = SendBuffers.GetData() + Index * SendSlotSize;
+		Slot.Hdr.msg_name = &Slot.Addr;
+		Slot.Hdr.msg_namelen = sizeof(sockaddr_in);
+		Slot.Hdr.msg_iov = &Slot.Iovec;
+		Slot.Hdr.msg_iovlen = 1;
+
+		FreeSendSlots.Add(Index);
+	}
+}
+
+FRedNetworkUringSocket::~FRedNetworkUringSocket()
+{
+	DrainRing();
+	CloseRing();
+}
+
+bool FRedNetworkUringSocket::Open(int32 Port, bool bReusePort)
+{
+	if (!FRedNetworkLinuxSocket::Open(Port, bReusePort)) return false;
+
+	if (!InitRing())
+	{
+		UE_LOG(LogRedNetwork, Warning, TEXT("Socket io_uring unavailable (errno %i), fall back to recvmmsg/sendmmsg."), errno);
+		CloseRing();
+		return true;
+	}
+
+	ArmRecv();
+	Submit();
+
+	UE_LOG(LogRedNetwork, Log, TEXT("Socket io_uring enabled."));
+
+	return true;
+}
+
+int32 FRedNetworkUringSocket::RecvBatch(TArray<FRedNetworkDatagram>& OutDatagrams)
+{
+	if (!bRingRecv) return FRedNetworkLinuxSocket::RecvBatch(OutDatagrams);
+
+	for (uint16 BufferID : DeliveredRecvBuffers)
+	{
+		RecycleRecvBuffer(BufferID);
+	}
+
+	DeliveredRecvBuffers.Reset();
+
+	ReapCompletions();
+
+	// Multishot ends when the buffer ring runs dry, repost once buffers are back
+	if (bRingRecv && !bRecvArmed)
+	{
+		ArmRecv();
+		Submit();
+	}
+
+	if (!bRingRecv) return FRedNetworkLinuxSocket::RecvBatch(OutDatagrams);
+
+	OutDatagrams.SetNum(0, false);
+
+	for (uint16 BufferID : PendingRecvBuffers)
+	{
+		DeliveredRecvBuffers.Add(BufferID);
+
+		const uint8* Buffer = RecvBuffers.GetData() + BufferID * RecvBufferSize;
+		const io_uring_recvmsg_out* RecvOut = reinterpret_cast<const io_uring_recvmsg_out*>(Buffer);
+
+		if (RecvOut->flags & MSG_TRUNC) continue;
+		if (RecvOut->namelen < sizeof(sockaddr_in)) continue;
+
+		const uint8* Name = Buffer + sizeof(io_uring_recvmsg_out);
+		const uint8* Payload = Name + RecvHdr.msg_namelen + RecvHdr.msg_controllen;
+
+		const sockaddr_in& NativeAddr = *reinterpret_cast<const sockaddr_in*>(Name);
+
+		OutDatagrams.Add({ Payload, (int32)RecvOut->payloadlen, ToEndpoint(NativeAddr) });
+	}
+
+	PendingRecvBuffers.Reset();
+
+	return OutDatagrams.Num();
+}
+
+void FRedNetworkUringSocket::SendTo(const uint8* Data, int32 Count, const FInternetAddr& Addr)
+{
+	if (!bRingSend || Count > SendSlotSize)
+	{
+		FRedNetworkLinuxSocket::SendTo(Data, Count, Addr);
+		return;
+	}
+
+	if (FreeSendSlots.Num() == 0)
+	{
+		Submit();
+		ReapCompletions();
+	}
+
+	io_uring_sqe* Sqe = FreeSendSlots.Num() > 0 ? GetSqe() : nullptr;
+
+	// Every slot is still in flight, send the overflow right behind what the ring holds so datagrams keep their order
+	if (Sqe == nullptr)
+	{
+		Submit();
+
+		FRedNetworkLinuxSocket::SendTo(Data, Count, Addr);
+		FRedNetworkLinuxSocket::Flush();
+		return;
+	}
+
+	const int32 SlotIndex = FreeSendSlots.Pop(false);
+	FSendSlot& Slot = SendSlotInfos[SlotIndex];
+
+	FMemory::Memcpy(Slot.Iovec.iov_base, Data, Count);
+	Slot.Iovec.iov_len = Count;
+
+	ToNativeAddr(Addr, Slot.Addr);
+
+	Sqe->opcode = IORING_OP_SENDMSG;
+	Sqe->fd = Socket;
+	Sqe->addr = (uint64)&Slot.Hdr;
+	Sqe->len = 1;
+	Sqe->user_data = SlotIndex;
+}
+
+void FRedNetworkUringSocket::Flush()
+{
+	if (bRingSend)
+	{
+		Submit();
+		ReapCompletions();
+	}
+
+	FRedNetworkLinuxSocket::Flush();
+}
+
+void FRedNetworkUringSocket::Wait(FTimespan Timeout)
+{
+	// Without a posted receive the socket itself becomes readable
+	if (!bRingRecv)
+	{
+		FRedNetworkLinuxSocket::Wait(Timeout);
+		return;
+	}
+
+	if (PendingRecvBuffers.Num() > 0 || HasCompletions()) return;
+
+	// WakeEvent is registered with the ring, so it fires on every completion as well as on Wake
+	pollfd Fd;
+	Fd.fd = WakeEvent;
+	Fd.events = POLLIN;
+	Fd.revents = 0;
+
+	const int TimeoutMs = FMath::CeilToInt(FMath::Max(Timeout.GetTotalMilliseconds(), 0.0));
+
+	if (poll(&Fd, 1, TimeoutMs) <= 0) return;
+
+	eventfd_t Value;
+	eventfd_read(WakeEvent, &Value);
+}
+
+bool FRedNetworkUringSocket::InitRing()
+{
+	if (WakeEvent < 0) return false;
+
+	io_uring_params Params;
+	FMemory::Memzero(Params);
+
+	RingFd = UringSetup(RingEntries, &Params);
+
+	if (RingFd < 0) return false;
+
+	SqRingSize = Params.sq_off.array + Params.sq_entries * sizeof(uint32);
+	CqRingSize = Params.cq_off.cqes + Params.cq_entries * sizeof(io_uring_cqe);
+
+	if (Params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		SqRingSize = CqRingSize = FMath::Max(SqRingSize, CqRingSize);
+	}
+
+	SqRing = mmap(nullptr, SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingFd, IORING_OFF_SQ_RING);
+
+	if (SqRing == MAP_FAILED)
+	{
+		SqRing = nullptr;
+		return false;
+	}
+
+	if (Params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		CqRing = SqRing;
+	}
+	else
+	{
+		CqRing = mmap(nullptr, CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingFd, IORING_OFF_CQ_RING);
+
+		if (CqRing == MAP_FAILED)
+		{
+			CqRing = nullptr;
+			return false;
+		}
+	}
+
+	SqesSize = Params.sq_entries * sizeof(io_uring_sqe);
+	void* SqesPtr = mmap(nullptr, SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingFd, IORING_OFF_SQES);
+
+	if (SqesPtr == MAP_FAILED) return false;
+
+	Sqes = (io_uring_sqe*)SqesPtr;
+
+	uint8* Sq = (uint8*)SqRing;
+	SqHead = (uint32*)(Sq + Params.sq_off.head);
+	SqTail = (uint32*)(Sq + Params.sq_off.tail);
+	SqMask = (uint32*)(Sq + Params.sq_off.ring_mask);
+	SqArray = (uint32*)(Sq + Params.sq_off.array);
+	SqEntries = Params.sq_entries;
+	SqLocalTail = *SqTail;
+	NumUnsubmitted = 0;
+
+	uint8* Cq = (uint8*)CqRing;
+	CqHead = (uint32*)(Cq + Params.cq_off.head);
+	CqTail = (uint32*)(Cq + Params.cq_off.tail);
+	CqMask = (uint32*)(Cq + Params.cq_off.ring_mask);
+	Cqes = (io_uring_cqe*)(Cq + Params.cq_off.cqes);
+
+	if (UringRegister(RingFd, IORING_REGISTER_EVENTFD, &WakeEvent, 1) != 0) return false;
+
+	bRingSend = true;
+
+	// Provided buffer ring for the multishot receive, page aligned as the kernel requires
+	BufRingSize = NumRecvBuffers * sizeof(io_uring_buf);
+	void* BufRingPtr = mmap(nullptr, BufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (BufRingPtr == MAP_FAILED) return true;
+
+	BufRing = (io_uring_buf_ring*)BufRingPtr;
+
+	io_uring_buf_reg BufReg;
+	FMemory::Memzero(BufReg);
+	BufReg.ring_addr = (uint64)BufRing;
+	BufReg.ring_entries = NumRecvBuffers;
+	BufReg.bgid = RecvBufferGroup;
+
+	if (UringRegister(RingFd, IORING_REGISTER_PBUF_RING, &BufReg, 1) != 0)
+	{
+		UE_LOG(LogRedNetwork, Warning, TEXT("Socket io_uring buffer ring unavailable (errno %i), receive with recvmmsg."), errno);
+		munmap(BufRing, BufRingSize);
+		BufRing = nullptr;
+		return true;
+	}
+
+	RecvBuffers.SetNumUninitialized(NumRecvBuffers * RecvBufferSize);
+
+	for (int32 BufferID = 0; BufferID < NumRecvBuffers; ++BufferID)
+	{
+		RecycleRecvBuffer(BufferID);
+	}
+
+	RecvHdr.msg_namelen = sizeof(sockaddr_in);
+	RecvHdr.msg_controllen = 0;
+
+	bRingRecv = true;
+
+	return true;
+}
+
+void FRedNetworkUringSocket::DrainRing()
+{
+	if (RingFd < 0) return;
+
+	if (bRecvArmed)
+	{
+		io_uring_sqe* Sqe = GetSqe();
+
+		if (Sqe)
+		{
+			Sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			Sqe->fd = -1;
+			Sqe->addr = RecvUserData;
+			Sqe->user_data = CancelUserData;
+		}
+	}
+
+	Submit();
+
+	while (true)
+	{
+		ReapCompletions();
+
+		if (!bRecvArmed && FreeSendSlots.Num() == NumSendSlots) break;
+
+		if (UringEnter(RingFd, NumUnsubmitted, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+		{
+			UE_LOG(LogRedNetwork, Error, TEXT("Socket io_uring drain failed (errno %i)."), errno);
+			break;
+		}
+	}
+}
+
+void FRedNetworkUringSocket::CloseRing()
+{
+	bRingSend = false;
+	bRingRecv = false;
+	bRecvArmed = false;
+
+	if (RingFd >= 0)
+	{
+		close(RingFd);
+		RingFd = -1;
+	}
+
+	if (Sqes)
+	{
+		munmap(Sqes, SqesSize);
+		Sqes = nullptr;
+	}
+
+	if (CqRing && CqRing != SqRing) munmap(CqRing, CqRingSize);
+	CqRing = nullptr;
+
+	if (SqRing)
+	{
+		munmap(SqRing, SqRingSize);
+		SqRing = nullptr;
+	}
+
+	if (BufRing)
+	{
+		munmap(BufRing, BufRingSize);
+		BufRing = nullptr;
+	}
+}
+
+io_uring_sqe* FRedNetworkUringSocket::GetSqe()
+{
+	const uint32 Head = __atomic_load_n(SqHead, __ATOMIC_ACQUIRE);
+
+	if (SqLocalTail - Head >= SqEntries)
+	{
+		Submit();
+
+		if (SqLocalTail - __atomic_load_n(SqHead, __ATOMIC_ACQUIRE) >= SqEntries) return nullptr;
+	}
+
+	const uint32 Index = SqLocalTail & *SqMask;
+
+	io_uring_sqe* Sqe = &Sqes[Index];
+	FMemory::Memzero(*Sqe);
+
+	SqArray[Index] = Index;
+
+	++SqLocalTail;
+	++NumUnsubmitted;
+
+	return Sqe;
+}
+
+void FRedNetworkUringSocket::Submit()
+{
+	if (NumUnsubmitted == 0) return;
+
+	__atomic_store_n(SqTail, SqLocalTail, __ATOMIC_RELEASE);
+
+	const int Result = UringEnter(RingFd, NumUnsubmitted, 0, 0);
+
+	if (Result > 0) NumUnsubmitted -= FMath::Min<uint32>(Result, NumUnsubmitted);
+}
+
+void FRedNetworkUringSocket::ArmRecv()
+{
+	io_uring_sqe* Sqe = GetSqe();
+
+	if (Sqe == nullptr) return;
+
+	Sqe->opcode = IORING_OP_RECVMSG;
+	Sqe->fd = Socket;
+	Sqe->addr = (uint64)&RecvHdr;
+	Sqe->len = 1;
+	Sqe->ioprio = IORING_RECV_MULTISHOT;
+	Sqe->flags = IOSQE_BUFFER_SELECT;
+	Sqe->buf_group = RecvBufferGroup;
+	Sqe->user_data = RecvUserData;
+
+	bRecvArmed = true;
+}
+
+void FRedNetworkUringSocket::ReapCompletions()
+{
+	uint32 Head = *CqHead;
+	const uint32 Tail = __atomic_load_n(CqTail, __ATOMIC_ACQUIRE);
+
+	for (; Head != Tail; ++Head)
+	{
+		const io_uring_cqe& Cqe = Cqes[Head & *CqMask];
+
+		if (Cqe.user_data == CancelUserData) continue;
+
+		if (Cqe.user_data != RecvUserData)
+		{
+			FreeSendSlots.Add((int32)Cqe.user_data);
+			continue;
+		}
+
+		if (!(Cqe.flags & IORING_CQE_F_MORE)) bRecvArmed = false;
+
+		if (Cqe.flags & IORING_CQE_F_BUFFER)
+		{
+			const uint16 BufferID = Cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+
+			if (Cqe.res >= 0) PendingRecvBuffers.Add(BufferID);
+			else RecycleRecvBuffer(BufferID);
+		}
+		else if (Cqe.res == -EINVAL || Cqe.res == -EOPNOTSUPP)
+		{
+			// Kernel without multishot recvmsg, stop posting and let the socket be drained with recvmmsg
+			UE_LOG(LogRedNetwork, Warning, TEXT("Socket io_uring multishot receive unsupported, receive with recvmmsg."));
+			bRingRecv = false;
+		}
+	}
+
+	__atomic_store_n(CqHead, Head, __ATOMIC_RELEASE);
+}
+
+void FRedNetworkUringSocket::RecycleRecvBuffer(uint16 BufferID)
+{
+	io_uring_buf* Buf = GetRingBuf(BufRing, BufRingTail & (NumRecvBuffers - 1));
+	Buf->addr = (uint64)(RecvBuffers.GetData() + BufferID * RecvBufferSize);
+	Buf->len = RecvBufferSize;
+	Buf->bid = BufferID;
+
+	++BufRingTail;
+
+	// The tail overlays the first entry's reserved field
+	__atomic_store_n(&BufRing->tail, BufRingTail, __ATOMIC_RELEASE);
+}
+
+bool FRedNetworkUringSocket::HasCompletions() const
+{
+	return *CqHead != __atomic_load_n(CqTail, __ATOMIC_ACQUIRE);
+}
+
+#endif
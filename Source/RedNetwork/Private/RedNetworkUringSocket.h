@@ -0,0 +1,118 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "RedNetworkLinuxSocket.h"
+
+// Multishot recvmsg and provided buffer rings arrived together in the 6.0 headers, older ones build without the backend
+#if PLATFORM_LINUX && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+THIRD_PARTY_INCLUDES_START
+#include <linux/io_uring.h>
+THIRD_PARTY_INCLUDES_END
+#ifdef IORING_RECV_MULTISHOT
+#define RED_NETWORK_WITH_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifndef RED_NETWORK_WITH_IO_URING
+#define RED_NETWORK_WITH_IO_URING 0
+#endif
+
+#if RED_NETWORK_WITH_IO_URING
+
+/**
+ * io_uring socket: one multishot recvmsg stays posted into a registered buffer ring and sends are submitted in batches on Flush.
+ * Falls back to the recvmmsg/sendmmsg path when the kernel cannot set up the ring.
+ */
+class FRedNetworkUringSocket : public FRedNetworkLinuxSocket
+{
+public:
+
+	static constexpr uint32 RingEntries = 1024;
+
+	/** Must be a power of two, each buffer holds one datagram of up to RecvSlotSize. */
+	static constexpr int32 NumRecvBuffers = 256;
+
+	static constexpr int32 NumSendSlots = 256;
+
+	FRedNetworkUringSocket();
+
+	virtual ~FRedNetworkUringSocket() override;
+
+	//~ Begin FRedNetworkSocket Interface
+	virtual bool Open(int32 Port, bool bReusePort) override;
+	virtual int32 RecvBatch(TArray<FRedNetworkDatagram>& OutDatagrams) override;
+	virtual void SendTo(const uint8* Data, int32 Count, const FInternetAddr& Addr) override;
+	virtual void Flush() override;
+	virtual void Wait(FTimespan Timeout) override;
+	//~ End FRedNetworkSocket Interface
+
+private:
+
+	int RingFd;
+
+	bool bRingSend;
+	bool bRingRecv;
+	bool bRecvArmed;
+
+	void* SqRing;
+	SIZE_T SqRingSize;
+	void* CqRing;
+	SIZE_T CqRingSize;
+	io_uring_sqe* Sqes;
+	SIZE_T SqesSize;
+
+	uint32* SqHead;
+	uint32* SqTail;
+	uint32* SqMask;
+	uint32* SqArray;
+	uint32 SqEntries;
+	uint32 SqLocalTail;
+	uint32 NumUnsubmitted;
+
+	uint32* CqHead;
+	uint32* CqTail;
+	uint32* CqMask;
+	io_uring_cqe* Cqes;
+
+	io_uring_buf_ring* BufRing;
+	SIZE_T BufRingSize;
+	uint16 BufRingTail;
+
+	TArray<uint8> RecvBuffers;
+	msghdr RecvHdr;
+
+	/** Completed receives not yet handed out, and handed out ones returned to the ring on the next RecvBatch. */
+	TArray<uint16> PendingRecvBuffers;
+	TArray<uint16> DeliveredRecvBuffers;
+
+	struct FSendSlot
+	{
+		sockaddr_in Addr;
+		iovec Iovec;
+		msghdr Hdr;
+	};
+
+	TArray<uint8> SendBuffers;
+	FSendSlot SendSlotInfos[NumSendSlots];
+	TArray<int32> FreeSendSlots;
+
+	bool InitRing();
+
+	/** Cancels the posted receive and waits out every send in flight, their buffers are freed with the socket. */
+	void DrainRing();
+
+	void CloseRing();
+
+	io_uring_sqe* GetSqe();
+	void Submit();
+	void ArmRecv();
+	void ReapCompletions();
+	void RecycleRecvBuffer(uint16 BufferID);
+
+	bool HasCompletions() const;
+
+};
+
+#endif
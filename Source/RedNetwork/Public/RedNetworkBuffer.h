@@ -0,0 +1,61 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Templates/RefCounting.h"
+
+class FRedNetworkBufferPool;
+
+/** Pooled byte buffer with an intrusive reference count, goes back to its pool when the last reference drops. */
+class REDNETWORK_API FRedNetworkBuffer
+{
+public:
+
+	TArray<uint8> Data;
+
+	TArrayView<const uint8> GetView() const { return Data; }
+
+	uint32 AddRef() const { return ++NumRefs; }
+	uint32 Release() const;
+	uint32 GetRefCount() const { return NumRefs; }
+
+private:
+
+	friend class FRedNetworkBufferPool;
+
+	mutable TAtomic<uint32> NumRefs { 0 };
+
+	/** Keeps the pool alive while the buffer is out, so messages may outlive their server or client. */
+	TSharedPtr<FRedNetworkBufferPool, ESPMode::ThreadSafe> Pool;
+
+};
+
+/** A received message, hold the reference to keep its bytes without copying. */
+using FRedNetworkMessage = TRefCountPtr<FRedNetworkBuffer>;
+
+/** Thread-safe free list of buffers, buffers keep their capacity so steady-state traffic does not allocate. */
+class REDNETWORK_API FRedNetworkBufferPool : public TSharedFromThis<FRedNetworkBufferPool, ESPMode::ThreadSafe>
+{
+public:
+
+	/** Free buffers kept beyond this are deleted. */
+	static constexpr int32 MaxFreeBuffers = 1024;
+
+	/** Buffers grown past this are trimmed on return instead of pinning the memory. */
+	static constexpr int32 MaxPooledCapacity = 64 * 1024;
+
+	~FRedNetworkBufferPool();
+
+	/** Buffer with Size uninitialized bytes. */
+	FRedNetworkMessage Acquire(int32 Size);
+
+private:
+
+	friend class FRedNetworkBuffer;
+
+	FCriticalSection Lock;
+
+	TArray<FRedNetworkBuffer*> FreeBuffers;
+
+	void Return(FRedNetworkBuffer* Buffer);
+
+};
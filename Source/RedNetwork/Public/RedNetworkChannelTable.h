@@ -0,0 +1,89 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Sparse table over the 256 channel numbers, only channels in use take room.
+ * A bitmask marks active channels and entries are kept in channel order, so an entry's index is the count of lower bits set.
+ */
+template <typename ValueType, int32 NumInline = 4>
+class TRedNetworkChannelTable
+{
+public:
+
+	struct FEntry
+	{
+		uint8 Channel;
+		ValueType Value;
+	};
+
+	bool Contains(uint8 Channel) const
+	{
+		return (Mask[Channel >> 6] & (1ull << (Channel & 63))) != 0;
+	}
+
+	ValueType* Find(uint8 Channel)
+	{
+		return Contains(Channel) ? &Entries[GetEntryIndex(Channel)].Value : nullptr;
+	}
+
+	const ValueType* Find(uint8 Channel) const
+	{
+		return Contains(Channel) ? &Entries[GetEntryIndex(Channel)].Value : nullptr;
+	}
+
+	/** Adding may move other entries, do not hold references across it. */
+	ValueType& FindOrAdd(uint8 Channel)
+	{
+		const int32 Index = GetEntryIndex(Channel);
+
+		if (!Contains(Channel))
+		{
+			Mask[Channel >> 6] |= 1ull << (Channel & 63);
+
+			Entries.Insert(FEntry{ Channel, ValueType() }, Index);
+		}
+
+		return Entries[Index].Value;
+	}
+
+	int32 Num() const { return Entries.Num(); }
+
+	FEntry& operator[](int32 Index) { return Entries[Index]; }
+	const FEntry& operator[](int32 Index) const { return Entries[Index]; }
+
+	void Reset()
+	{
+		FMemory::Memzero(Mask);
+		Entries.Reset();
+	}
+
+private:
+
+	uint64 Mask[4] = { };
+
+	TArray<FEntry, TInlineAllocator<NumInline>> Entries;
+
+	int32 GetEntryIndex(uint8 Channel) const
+	{
+		const int32 Word = Channel >> 6;
+
+		int32 Index = FMath::CountBits(Mask[Word] & ((1ull << (Channel & 63)) - 1));
+
+		for (int32 Lower = 0; Lower < Word; ++Lower)
+		{
+			Index += FMath::CountBits(Mask[Lower]);
+		}
+
+		return Index;
+	}
+
+public:
+
+	/** Ranged-for over entries in channel order. */
+	auto begin() { return Entries.begin(); }
+	auto end() { return Entries.end(); }
+	auto begin() const { return Entries.begin(); }
+	auto end() const { return Entries.end(); }
+
+};
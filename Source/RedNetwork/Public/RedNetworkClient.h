@@ -4,6 +4,8 @@
 #include "Misc/DateTime.h"
 #include "UObject/Object.h"
 #include "RedNetworkType.h"
+#include "RedNetworkOutput.h"
+#include "RedNetworkChannelTable.h"
 #include "RedNetworkClient.generated.h"
 
 class FKCPWrap;
@@ -19,6 +21,9 @@ public:
 	DECLARE_DYNAMIC_MULTICAST_SPARSE_DELEGATE(FLoginSignature, URedNetworkClient, OnLogin);
 	DECLARE_DYNAMIC_MULTICAST_SPARSE_DELEGATE_TwoParams(FRecvSignature, URedNetworkClient, OnRecv, uint8, Channel, const TArray<uint8>&, Data);
 	DECLARE_DYNAMIC_MULTICAST_SPARSE_DELEGATE(FUnloginSignature, URedNetworkClient, OnUnlogin);
+	DECLARE_DYNAMIC_MULTICAST_SPARSE_DELEGATE_OneParam(FWritableSignature, URedNetworkClient, OnWritable, uint8, Channel);
+
+	DECLARE_MULTICAST_DELEGATE_TwoParams(FNativeRecvSignature, uint8 /* Channel */, const FRedNetworkMessage& /* Message */);
 
 public:
 
@@ -31,6 +36,13 @@ public:
 	UPROPERTY(BlueprintAssignable, Category = "Red|Network")
 	FUnloginSignature OnUnlogin;
 
+	/** A channel that hit its MaxWaitSent has drained to half of it. */
+	UPROPERTY(BlueprintAssignable, Category = "Red|Network")
+	FWritableSignature OnWritable;
+
+	/** Broadcast before OnRecv without reflection, Message->GetView() reads the bytes and holding Message keeps them. */
+	FNativeRecvSignature OnNativeRecv;
+
 public:
 
 	UFUNCTION(BlueprintCallable, Category = "Red|Network")
@@ -42,12 +54,20 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "Red|Network")
 	void Deactivate();
 
+	/** True once the server registered the connection, the provisional ID of the ready pass is never reported. */
 	UFUNCTION(BlueprintCallable, Category = "Red|Network")
-	bool IsLogged() const { return ClientPass.IsValid(); }
+	bool IsLogged() const { return ClientPass.ID > 0; }
 
 	UFUNCTION(BlueprintCallable, Category = "Red|Network")
 	bool Send(uint8 Channel, const TArray<uint8>& Data);
 
+	/** Segments waiting in KCP for the channel, queued and in flight. */
+	UFUNCTION(BlueprintCallable, Category = "Red|Network")
+	int32 GetWaitSent(uint8 Channel) const;
+
+	/** Receives every ready message straight into OutBatch when bPollMessages is set, returns how many were added. */
+	int32 PollMessages(FRedNetworkMessageBatch& OutBatch);
+
 public:
 
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
@@ -62,34 +82,120 @@ public:
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
 	int32 KCPLogMask = 0;
 
+	/** Leave received messages in KCP for PollMessages instead of broadcasting OnRecv and OnNativeRecv. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	bool bPollMessages = false;
+
+	/** Channels carried as raw datagrams outside KCP, no retransmission or ordering and at most FRedNetworkRecord::MaxUnreliableSize bytes, must match the server. Fixed while active. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	TSet<uint8> UnreliableChannels;
+
+	/** Unreliable channels that also drop anything older than the newest message delivered, at most FRedNetworkSequence::MaxMessageSize bytes, must match the server. Fixed while active. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	TSet<uint8> SequencedChannels;
+
+	/** KCP tuning per reliable channel, channels not listed use DefaultChannelConfig. Both are copied on Activate and fixed while active. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	TMap<uint8, FRedNetworkChannelConfig> ChannelConfigs;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	FRedNetworkChannelConfig DefaultChannelConfig;
+
+	/** KCP bytes flushed per tick, channels go by Priority then Weight while it lasts. It holds back new data only, ACKs and resends always go out. 0 is unlimited. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network", meta = (ClampMin = "0"))
+	int32 ConnectionBytesPerTick = 0;
+
+	/** Bytes per second put on the wire, datagrams beyond it wait for a later tick. 0 is unlimited. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network", meta = (ClampMin = "0"))
+	int32 PacingRate = 0;
+
+	/** Pace at the KCP windows over smoothed RTT instead, capped by PacingRate when that is set. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	bool bEstimatePacingRate = false;
+
+	/** Bytes the bucket saves up while idle and may send back to back. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network", meta = (ClampMin = "1472"))
+	int32 PacingBurst = 16 * 1024;
+
 private:
 
 	bool bIsActive = false;
 
 	TSharedPtr<FInternetAddr> ServerAddrPtr;
 
+	/** Reused by every RecvFrom. */
+	TSharedPtr<FInternetAddr> SourceAddrPtr;
+
 	FSocket* SocketPtr;
 
-	TArray<uint8> SendBuffer;
 	TArray<uint8> RecvBuffer;
 
+	TSharedPtr<FRedNetworkBufferPool, ESPMode::ThreadSafe> BufferPool;
+
 	FRedNetworkPass ClientPass;
 
 	FDateTime LastRecvTime;
 	FDateTime LastHeartbeat;
 
-	TArray<TSharedPtr<FKCPWrap>> KCPUnits;
+	TRedNetworkChannelTable<TSharedPtr<FKCPWrap>> KCPUnits;
+
+	/** Channels with FEC enabled, also held by the output function of their unit. */
+	TRedNetworkChannelTable<TSharedPtr<FRedNetworkFEC>> FECs;
+
+	TRedNetworkChannelTable<FRedNetworkSequence> Sequences;
+
+	/** Output scaled by the inverse of the channel weight, the lowest flushes first within a priority. */
+	TRedNetworkChannelTable<uint64> VirtualTimes;
+
+	/** Sends to the server address through the client socket. */
+	struct FClientOutput : public FRedNetworkOutput
+	{
+		URedNetworkClient* Client = nullptr;
+
+	protected:
+
+		virtual void SendTo(const uint8* Data, int32 Count) override;
+	};
+
+	/** Output of every channel, sent after each update. Its pass is set on login. */
+	FClientOutput Output;
+
+	uint32 TickCount = 0;
+
+	/** Channels whose last send hit MaxWaitSent, OnWritable is pending. */
+	TSet<uint8> BlockedChannels;
+
+	/** Unreliable messages held for PollMessages, KCP channels keep theirs in KCP. */
+	FRedNetworkMessageBatch UnreliableMessages;
 
 	FDateTime NowTime;
 
 	void UpdateKCP();
+
+	bool IsPacingEnabled() const { return PacingRate > 0 || bEstimatePacingRate; }
+
+	void SendPacedDatagrams();
+	void HandleWritable();
 	void SendHeartbeat();
 	void HandleSocketRecv();
 	void HandleLoginRecv(const FRedNetworkPass& SourcePass);
 	void HandleKCPRecv();
+	void HandleUnreliableRecv(const FRedNetworkRecord& Record);
+	void BroadcastRecv(uint8 Channel, const FRedNetworkMessage& Message);
 	void HandleTimeout();
 
-	void EnsureChannelCreated(uint8 Channel);
+	/** Taken by Activate, edits to the properties above wait for the next activation. */
+	FRedNetworkChannelSettings ChannelSettings;
+
+	bool IsUnreliableChannel(uint8 Channel) const { return ChannelSettings.IsUnreliableChannel(Channel); }
+	bool IsSequencedChannel(uint8 Channel) const { return ChannelSettings.IsSequencedChannel(Channel); }
+	const FRedNetworkChannelConfig& GetChannelConfig(uint8 Channel) const { return ChannelSettings.GetChannelConfig(Channel); }
+	int32 GetMaxUnreliableSize(uint8 Channel) const { return ChannelSettings.GetMaxUnreliableSize(Channel); }
+
+	FKCPWrap& EnsureChannelCreated(uint8 Channel);
+
+	/** Updates the unit and closes an FEC group that timed out, at most MaxNewSegments of queued data go out. */
+	void UpdateChannel(uint8 Channel, FKCPWrap& KCPUnit, uint32 Current, int32 MaxNewSegments);
 
 public:
 
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Interleaved XOR parity over groups of KCP packets of one channel, sits between KCP and the record framing.
+ * Packet i of a group is covered by parity i % ParityShards, so up to ParityShards consecutive losses are rebuilt without a resend.
+ * A data packet is led by [group uint16, index], a parity by [group uint16, 0x80 | stripe, data count, parity count, XOR of the data lengths uint16].
+ * Packets of only ACKs and window probes are not worth a resend and go out with UnprotectedIndex outside any group.
+ */
+class REDNETWORK_API FRedNetworkFEC
+{
+public:
+
+	static constexpr int32 DataHeaderSize = 3;
+	static constexpr int32 ParityHeaderSize = 7;
+
+	static constexpr int32 MaxDataShards = 64;
+	static constexpr int32 MaxParityShards = 16;
+
+	static constexpr uint8 UnprotectedIndex = 0x7F;
+
+	/** Milliseconds a partial group waits for more packets before its parity goes out. */
+	static constexpr int32 GroupTimeout = 20;
+
+	/** Packet has FRedNetworkRecord::FrameSize of room in front of its Count bytes, as KCP output with the frame reserved. */
+	using FOutput = TFunctionRef<void(uint8* Packet, int32 Count)>;
+
+	using FInput = TFunctionRef<void(const uint8* Data, int32 Count)>;
+
+	FRedNetworkFEC(int32 InDataShards, int32 InParityShards);
+
+	/** Packet is KCP output with FrameSize + ParityHeaderSize reserved, the data header is written into that room. */
+	void Encode(uint8* Packet, int32 Count, uint32 Current, FOutput Output);
+
+	/** Closes a partial group once it is GroupTimeout old, call after every KCP update so the tail of a burst is covered as well. */
+	void Flush(uint32 Current, FOutput Output);
+
+	/** When Flush closes the open group, false without one. */
+	bool GetFlushTime(uint32& OutTime) const;
+
+	/** Data is a record payload, Input gets its KCP bytes and any packet it completes. False for a malformed record. */
+	bool Decode(const uint8* Data, int32 Count, FInput Input);
+
+	/** Dest ^= Src, a vector register at a time. */
+	static void XorBytes(uint8* Dest, const uint8* Src, int32 Count);
+
+private:
+
+	/** Groups kept for late packets, older ones are overwritten. */
+	static constexpr int32 NumRecvGroups = 8;
+
+	struct FParity
+	{
+		/** Frame room, parity header and the XOR of the data. */
+		TArray<uint8> Buffer;
+		uint16 LengthXor = 0;
+	};
+
+	struct FRecvGroup
+	{
+		uint16 Group = 0;
+		bool bUsed = false;
+
+		/** Unknown until a parity arrives. */
+		int32 DataCount = 0;
+		int32 ParityCount = 0;
+
+		uint64 DataMask = 0;
+		uint32 ParityMask = 0;
+
+		/** Grown to the highest index seen, and to DataCount for a recovery. */
+		TArray<TArray<uint8>> Shards;
+		TArray<FParity> Parities;
+	};
+
+	int32 DataShards;
+	int32 ParityShards;
+
+	uint16 SendGroup = 0;
+	int32 SendIndex = 0;
+	uint32 SendGroupTime = 0;
+	TArray<FParity> SendParities;
+
+	FRecvGroup RecvGroups[NumRecvGroups];
+
+	/** Closes the group now, whatever its age. */
+	void CloseGroup(FOutput Output);
+
+	FRecvGroup* FindRecvGroup(uint16 Group);
+
+	/** True when Packet carries no data segment, only ACKs and window probes. */
+	static bool IsControlOnly(const uint8* Packet, int32 Count);
+
+	void Recover(FRecvGroup& RecvGroup, int32 Stripe, FInput Input);
+
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "RedNetworkType.h"
+
+/**
+ * Sending side of one connection, shared by the client and every server connection.
+ * KCP output of all channels is packed as records into one datagram, channels share a byte budget per tick by priority and weight,
+ * and datagrams wait for the pacing buckets. The owner puts datagrams on the wire and tracks what needs a later call.
+ */
+class REDNETWORK_API FRedNetworkOutput
+{
+public:
+
+	/** Beyond it datagrams are dropped instead of held. */
+	static constexpr int32 MaxPacedDatagrams = 1024;
+
+	FRedNetworkOutput() = default;
+	FRedNetworkOutput(const FRedNetworkOutput&) = default;
+	FRedNetworkOutput(FRedNetworkOutput&&) = default;
+	FRedNetworkOutput& operator=(const FRedNetworkOutput&) = default;
+	FRedNetworkOutput& operator=(FRedNetworkOutput&&) = default;
+	virtual ~FRedNetworkOutput() = default;
+
+	/** Leads every datagram. */
+	FRedNetworkPass Pass;
+
+	/** Hold datagrams while Pacer, or SharedPacer when set, has no tokens left. */
+	bool bPacing = false;
+
+	FRedNetworkPacer Pacer;
+
+	/** Bucket shared with other connections, both have to allow a datagram. */
+	FRedNetworkPacer* SharedPacer = nullptr;
+
+	/** Held datagrams are copied into its buffers. */
+	FRedNetworkBufferPool* BufferPool = nullptr;
+
+	/** Order of the channels of a connection when the budget runs short, higher priority first and then the lowest virtual time. */
+	static bool IsUpdatedBefore(int32 PriorityA, uint64 VirtualTimeA, int32 PriorityB, uint64 VirtualTimeB);
+
+	/** Starts the budget of Tick, later calls within the same tick keep what is left. 0 BytesPerTick is unlimited. */
+	void RefillBudget(uint32 Tick, int32 BytesPerTick);
+
+	/** Runs Update with the queued segments of MSS bytes the budget lets out, then charges the budget and ChannelTime with what it emitted. */
+	void UpdateChannel(uint64& ChannelTime, int32 Weight, uint32 MSS, TFunctionRef<void(int32 MaxNewSegments)> Update);
+
+	/** Packet is KCP output led by FRedNetworkRecord::FrameSize bytes of header room. */
+	void Queue(uint8 Channel, uint8* Packet, int32 Count);
+
+	/** Returns where to write the Count bytes of the new record. */
+	uint8* Append(uint8 Channel, int32 Count);
+
+	/** Sends the pending datagram if any. */
+	void Flush();
+
+	/** Every datagram but heartbeats goes through here, it is held while the pacing buckets are empty. */
+	void SendDatagram(const uint8* Data, int32 Count);
+
+	/** Sends held datagrams in order while the buckets last, true when some are still held. */
+	bool SendPacedDatagrams();
+
+	void Reset();
+
+protected:
+
+	virtual void SendTo(const uint8* Data, int32 Count) = 0;
+
+	/** Brings the buckets up to date before their tokens are checked. */
+	virtual void RefillPacing() {}
+
+	/** The pending datagram took its first record, Flush has to follow before the tick ends. */
+	virtual void OnPending() {}
+
+	/** The first datagram is held, SendPacedDatagrams has to follow on later ticks. */
+	virtual void OnPaced() {}
+
+private:
+
+	/** Records waiting to share a datagram until the next one would pass FRedNetworkRecord::MaxDatagramSize. */
+	TArray<uint8> PendingDatagram;
+
+	/** Datagrams waiting for pacing tokens, sent in order before anything newer. */
+	TArray<FRedNetworkMessage> PacedDatagrams;
+
+	uint64 OutputBytes = 0;
+
+	/** Bytes left of the tick, negative after an overshoot. */
+	int64 Budget = 0;
+	int32 BytesPerTick = 0;
+	uint32 BudgetTick = 0;
+
+	uint64 VirtualTime = 0;
+
+	bool CanSend() const;
+	void Spend(int32 Count);
+};
@@ -3,12 +3,18 @@
 #include "CoreMinimal.h"
 #include "Misc/DateTime.h"
 #include "UObject/Object.h"
+#include "Containers/Queue.h"
 #include "RedNetworkType.h"
+#include "RedNetworkOutput.h"
+#include "RedNetworkSlotMap.h"
+#include "RedNetworkChannelTable.h"
 #include "RedNetworkServer.generated.h"
 
-class FSocket;
 class FKCPWrap;
 class FInternetAddr;
+class FRunnableThread;
+class FRedNetworkRunnable;
+class FRedNetworkSocket;
 
 UCLASS(BlueprintType)
 class REDNETWORK_API URedNetworkServer : public UObject, public FTickableGameObject
@@ -20,6 +26,9 @@ public:
 	DECLARE_DYNAMIC_MULTICAST_SPARSE_DELEGATE_OneParam(FLoginSignature, URedNetworkServer, OnLogin, int32, ClientID);
 	DECLARE_DYNAMIC_MULTICAST_SPARSE_DELEGATE_ThreeParams(FRecvSignature, URedNetworkServer, OnRecv, int32, ClientID, uint8, Channel, const TArray<uint8>&, Data);
 	DECLARE_DYNAMIC_MULTICAST_SPARSE_DELEGATE_OneParam(FUnloginSignature, URedNetworkServer, OnUnlogin, int32, ClientID);
+	DECLARE_DYNAMIC_MULTICAST_SPARSE_DELEGATE_TwoParams(FWritableSignature, URedNetworkServer, OnWritable, int32, ClientID, uint8, Channel);
+
+	DECLARE_MULTICAST_DELEGATE_ThreeParams(FNativeRecvSignature, int32 /* ClientID */, uint8 /* Channel */, const FRedNetworkMessage& /* Message */);
 
 public:
 
@@ -32,6 +41,13 @@ public:
 	UPROPERTY(BlueprintAssignable, Category = "Red|Network")
 	FUnloginSignature OnUnlogin;
 
+	/** A channel that hit its MaxWaitSent has drained to half of it. */
+	UPROPERTY(BlueprintAssignable, Category = "Red|Network")
+	FWritableSignature OnWritable;
+
+	/** Broadcast before OnRecv without reflection, Message->GetView() reads the bytes and holding Message keeps them. */
+	FNativeRecvSignature OnNativeRecv;
+
 public:
 
 	UFUNCTION(BlueprintCallable, Category = "Red|Network")
@@ -46,6 +62,23 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "Red|Network")
 	bool Send(int32 ClientID, uint8 Channel, const TArray<uint8>& Data);
 
+	/** Sends one payload to every client, copied once however many clients there are. Returns how many clients took it. */
+	UFUNCTION(BlueprintCallable, Category = "Red|Network")
+	int32 SendToMany(const TArray<int32>& ClientIDs, uint8 Channel, const TArray<uint8>& Data);
+
+	/** SendToMany without the copy, fill a buffer from CreateMessage and every shard shares it. */
+	int32 SendMessageToMany(TArrayView<const int32> ClientIDs, uint8 Channel, const FRedNetworkMessage& Payload);
+
+	/** Segments waiting in KCP for the channel, queued and in flight. Threaded shards report the value of their last tick. */
+	UFUNCTION(BlueprintCallable, Category = "Red|Network")
+	int32 GetWaitSent(int32 ClientID, uint8 Channel) const;
+
+	/** Pooled buffer of Size uninitialized bytes for SendMessageToMany, null while inactive. */
+	FRedNetworkMessage CreateMessage(int32 Size) const;
+
+	/** Appends every message received since the last poll when bPollMessages is set, returns how many were added. */
+	int32 PollMessages(FRedNetworkMessageBatch& OutBatch);
+
 	TSharedPtr<FInternetAddr> GetSocketAddr() const;
 
 	UFUNCTION(BlueprintCallable, Category = "Red|Network")
@@ -65,24 +98,128 @@ public:
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
 	int32 KCPLogMask = 0;
 
+	/** Run socket and KCP work on a dedicated thread, events are still broadcast on the game thread. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	bool bUseNetworkThread = false;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	FTimespan NetworkThreadInterval = FTimespan::FromMilliseconds(1.0);
+
+	/** Network threads block until a datagram arrives or the nearest KCP deadline instead of sleeping NetworkThreadInterval. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	bool bEventDrivenWakeup = false;
+
+	/** Number of SO_REUSEPORT sockets bound to Port, each drained by its own network thread when greater than one. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network", meta = (ClampMin = "1"))
+	int32 NumShards = 1;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	ERedNetworkSocketBackend SocketBackend = ERedNetworkSocketBackend::Generic;
+
+	/** Hold received messages for PollMessages instead of broadcasting OnRecv and OnNativeRecv, login events still broadcast from Tick. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	bool bPollMessages = false;
+
+	/** Received bytes a shard holds for PollMessages. Beyond it reliable messages wait in KCP, whose window holds the client back, and unreliable ones are dropped. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network", meta = (ClampMin = "0"))
+	int32 MaxPolledBytes = 4 * 1024 * 1024;
+
+	/** Channels carried as raw datagrams outside KCP, no retransmission or ordering and at most FRedNetworkRecord::MaxUnreliableSize bytes, must match the client. Fixed while active. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	TSet<uint8> UnreliableChannels;
+
+	/** Unreliable channels that also drop anything older than the newest message delivered, at most FRedNetworkSequence::MaxMessageSize bytes, must match the client. Fixed while active. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	TSet<uint8> SequencedChannels;
+
+	/** KCP tuning per reliable channel, channels not listed use DefaultChannelConfig. Both are copied on Activate and fixed while active. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	TMap<uint8, FRedNetworkChannelConfig> ChannelConfigs;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	FRedNetworkChannelConfig DefaultChannelConfig;
+
+	/** KCP bytes a connection may flush per network tick, channels go by Priority then Weight while it lasts. It holds back new data only, ACKs and resends always go out. 0 is unlimited. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network", meta = (ClampMin = "0"))
+	int32 ConnectionBytesPerTick = 0;
+
+	/** Bytes per second each connection may put on the wire, datagrams beyond it wait for the bucket to refill. 0 is unlimited. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network", meta = (ClampMin = "0"))
+	int32 ConnectionPacingRate = 0;
+
+	/** Pace each connection at its KCP windows over smoothed RTT instead, capped by ConnectionPacingRate when that is set. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	bool bEstimatePacingRate = false;
+
+	/** Bytes per second of the whole server, split evenly between shards. 0 is unlimited. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network", meta = (ClampMin = "0"))
+	int32 ServerPacingRate = 0;
+
+	/** Bytes a bucket saves up while idle and may send back to back. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network", meta = (ClampMin = "1472"))
+	int32 PacingBurst = 16 * 1024;
+
 private:
 
 	bool bIsActive = false;
 
-	FSocket* SocketPtr;
+	struct FSendRequest
+	{
+		TArray<int32, TInlineAllocator<1>> ClientIDs;
+		uint8 Channel;
 
-	TArray<uint8> SendBuffer;
-	TArray<uint8> RecvBuffer;
+		/** Null to only mark the channel blocked, for a send refused on the game thread. */
+		FRedNetworkMessage Payload;
+	};
+
+	struct FForwardedPacket
+	{
+		FRedNetworkEndpoint Endpoint;
+		TArray<uint8> Data;
+	};
 
-	int32 NextReadyID;
-		
 	struct FReadyInfo
 	{
 		FDateTime Time;
 		FRedNetworkPass Pass;
+		TSharedPtr<FInternetAddr> Addr;
+	};
+
+	struct FChannelInfo
+	{
+		TSharedPtr<FKCPWrap> KCPUnit;
+
+		/** Null unless the channel has FEC enabled, also held by the output function of the unit. */
+		TSharedPtr<FRedNetworkFEC> FEC;
+
+		uint32 UpdateTime = 0;
+		bool bScheduled = false;
+
+		/** Set when a send hit MaxWaitSent, cleared with OnWritable. */
+		bool bBlocked = false;
+
+		/** Output scaled by the inverse of the weight, the lowest goes first within a priority. */
+		uint64 VirtualTime = 0;
+
+		int32 PublishedWaitSent = 0;
 	};
 
-	TMap<FString, FReadyInfo> ReadyPass;
+	struct FShard;
+
+	/** Sends through the shard socket under the connection and shard buckets. */
+	struct FConnectionOutput : public FRedNetworkOutput
+	{
+		URedNetworkServer* Server = nullptr;
+		FShard* Shard = nullptr;
+		uint32 PacingTick = 0;
+
+	protected:
+
+		virtual void SendTo(const uint8* Data, int32 Count) override;
+		virtual void RefillPacing() override;
+		virtual void OnPending() override;
+		virtual void OnPaced() override;
+	};
 
 	struct FConnectionInfo
 	{
@@ -90,24 +227,176 @@ private:
 		FDateTime RecvTime;
 		FDateTime Heartbeat;
 		TSharedPtr<FInternetAddr> Addr;
-		TArray<TSharedPtr<FKCPWrap>> KCPUnits;
+		FRedNetworkEndpoint Endpoint;
+		TRedNetworkChannelTable<FChannelInfo> Channels;
+		TRedNetworkChannelTable<FRedNetworkSequence> Sequences;
+
+		/** Provisional ID of the ready pass, still accepted until a datagram carries Pass.ID. 0 once one has. */
+		int32 ReadyID = 0;
+
+		/** Output of every channel, its pass is a copy of Pass. */
+		FConnectionOutput Output;
+	};
+
+	/** Min-heap entry of the next ikcp_check deadline, stale once the channel is rescheduled. */
+	struct FKCPTimer
+	{
+		uint32 Time;
+		int32 ClientID;
+		uint8 Channel;
+
+		bool operator<(const FKCPTimer& Other) const { return (int32)(Time - Other.Time) < 0; }
+	};
+
+	struct FDueChannel
+	{
+		int32 ClientID;
+		uint8 Channel;
+		int32 Priority;
+		uint64 VirtualTime;
 	};
 
-	TMap<int32, FConnectionInfo> Connections;
+	struct FShard
+	{
+		int32 Index;
+
+		TSharedPtr<FRedNetworkSocket> Socket;
+
+		TArray<uint8> SendBuffer;
+		TArray<FRedNetworkDatagram> Datagrams;
+
+		/** Received messages are handed out from here and come back once every reference is gone. */
+		TSharedPtr<FRedNetworkBufferPool, ESPMode::ThreadSafe> BufferPool;
+
+		TMap<FRedNetworkEndpoint, FReadyInfo> ReadyPass;
+
+		/** A slot is taken only once the client echoes its ready pass, the pass itself holds a provisional ID from NextReadyID. */
+		TRedNetworkSlotMap<FConnectionInfo> Connections;
+		uint32 NextReadyID = 0;
+
+		/** Provisional ID to client ID of connections whose client has not switched to its real ID yet. */
+		TMap<int32, int32> ReadyIDs;
+
+		FDateTime NowTime;
+		uint32 KCPClock;
+
+		TArray<FKCPTimer> KCPTimers;
+		TArray<FDueChannel> DueChannels;
+
+		uint32 TickCount = 0;
+
+		/** Share of ServerPacingRate. */
+		FRedNetworkPacer Pacer;
+		uint32 PacingTick = 0;
+
+		/** Connections holding paced datagrams. */
+		TArray<int32> PacedConnections;
+
+		/** Connections with a pending datagram to flush at the end of the tick, may repeat. */
+		TArray<int32> PendingConnections;
+
+		TSharedPtr<FRedNetworkRunnable> Runnable;
+		FRunnableThread* Thread = nullptr;
+
+		/** GetWaitSent of threaded shards reads WaitSent, changes of a tick are applied in one go. */
+		TArray<TPair<uint64, int32>> WaitSentUpdates;
+		FCriticalSection WaitSentLock;
+		TMap<uint64, int32> WaitSent;
+
+		/** Game thread view of threaded shards, clients whose OnLogin has been broadcast and OnUnlogin not yet. */
+		TSet<int32> LoggedClients;
+
+		TQueue<FSendRequest, EQueueMode::Mpsc> SendRequests;
+		TQueue<FForwardedPacket, EQueueMode::Mpsc> ForwardedPackets;
+		/** Events of one network tick go to the game thread as a batch, emptied batches come back to keep their capacity. */
+		TArray<FRedNetworkEvent> PendingEvents;
+		TQueue<TArray<FRedNetworkEvent>, EQueueMode::Spsc> NetworkEvents;
+		TQueue<TArray<FRedNetworkEvent>, EQueueMode::Spsc> RecycledEvents;
+
+		/** Messages for PollMessages, received straight into the arena and handed over per tick like the events. */
+		FRedNetworkMessageBatch PendingMessages;
+		TQueue<FRedNetworkMessageBatch, EQueueMode::Spsc> MessageBatches;
+		TQueue<FRedNetworkMessageBatch, EQueueMode::Spsc> RecycledMessages;
+
+		/** Arena bytes of the batches in MessageBatches, taken back by PollMessages. */
+		TAtomic<int64> QueuedMessageBytes { 0 };
+	};
+
+	TArray<TUniquePtr<FShard>> Shards;
+
+	/** Client ID is ((Generation << SlotIndexBits | SlotIndex) * Shards.Num() + Shard.Index), so the owning shard stays ID % Shards.Num(). */
+	static constexpr int32 SlotIndexBits = 16;
+
+	FShard& GetShard(int32 ClientID) const;
+
+	int32 MakeClientID(const FShard& Shard, int32 SlotIndex, uint32 Generation) const;
+
+	/** Negative, the client swaps it for the connection's ID once registered. */
+	int32 MakeReadyID(FShard& Shard) const;
+	void SplitClientID(int32 ClientID, int32& OutSlotIndex, uint32& OutGeneration) const;
+	FConnectionInfo* FindConnection(FShard& Shard, int32 ClientID) const;
+	void ReleaseClientID(FShard& Shard, int32 ClientID) const;
+
+	void TickNetwork(FShard& Shard);
+	void WaitNetwork(FShard& Shard);
+	void HandleSendRequests(FShard& Shard);
+	void HandleForwardedPackets(FShard& Shard);
+	void HandleNetworkEvents();
+	void PublishNetworkEvents(FShard& Shard);
+
+	void BroadcastRecv(int32 ClientID, uint8 Channel, const FRedNetworkMessage& Message);
+
+	void NotifyLogin(FShard& Shard, int32 ClientID);
+	void NotifyRecv(FShard& Shard, int32 ClientID, uint8 Channel, const FRedNetworkMessage& Message);
+	void NotifyUnlogin(FShard& Shard, int32 ClientID);
+	void NotifyWritable(FShard& Shard, int32 ClientID, uint8 Channel);
+
+	void UpdateKCP(FShard& Shard);
+	void SendHeartbeat(FShard& Shard);
+	void HandleSocketRecv(FShard& Shard);
+	void HandlePacket(FShard& Shard, const FRedNetworkDatagram& Datagram);
+	void SendReadyPass(FShard& Shard, const FRedNetworkDatagram& Datagram);
+	void RedirectConnection(FConnectionInfo& Info, const FRedNetworkDatagram& Datagram);
+	FConnectionInfo* RegisterConnection(FShard& Shard, const FRedNetworkPass& SourcePass, const FRedNetworkDatagram& Datagram);
+	void HandleKCPRecv(FShard& Shard);
+	void HandleUnreliableRecv(FShard& Shard, int32 ClientID, const FRedNetworkRecord& Record);
+	void HandleExpiredReadyPass(FShard& Shard);
+	void HandleExpiredConnection(FShard& Shard);
+
+	/** Taken by Activate, the properties above may change under it without reaching the network threads. */
+	FRedNetworkChannelSettings ChannelSettings;
+
+	bool IsUnreliableChannel(uint8 Channel) const { return ChannelSettings.IsUnreliableChannel(Channel); }
+	bool IsSequencedChannel(uint8 Channel) const { return ChannelSettings.IsSequencedChannel(Channel); }
+	const FRedNetworkChannelConfig& GetChannelConfig(uint8 Channel) const { return ChannelSettings.GetChannelConfig(Channel); }
+	int32 GetMaxUnreliableSize(uint8 Channel) const { return ChannelSettings.GetMaxUnreliableSize(Channel); }
+
+	FChannelInfo& EnsureChannelCreated(FShard& Shard, int32 ClientID, uint8 Channel);
+	void ScheduleKCP(FShard& Shard, int32 ClientID, uint8 Channel, uint32 Time);
+
+	/** Sends through the channel's KCP unit under its MaxWaitSent, false when refused. See FRedNetworkChannelConfig::Admit for bMayRefuse. */
+	bool SendKCP(FShard& Shard, int32 ClientID, uint8 Channel, const uint8* Data, int32 Count, uint32 Time, bool bMayRefuse = true);
+
+	/** Game thread check of a threaded shard's send against the published WaitSent, true when Reject refuses it. */
+	bool IsSendRefused(int32 ClientID, uint8 Channel) const;
+
+	static uint64 MakeChannelKey(int32 ClientID, uint8 Channel) { return (uint64)(uint32)ClientID << 8 | Channel; }
+
+	/** Returns how many of ClientIDs were connected, several clients get one datagram encoded once. */
+	int32 SendUnreliable(FShard& Shard, TArrayView<const int32> ClientIDs, uint8 Channel, const uint8* Data, int32 Count);
+	void FlushPendingOutputs(FShard& Shard);
+
+	/** Whether Count more bytes fit under MaxPolledBytes, a lone message always does. */
+	bool CanHoldMessage(const FShard& Shard, int32 Count) const;
 
-	FDateTime NowTime;
+	bool IsPacingEnabled() const { return ConnectionPacingRate > 0 || bEstimatePacingRate || ServerPacingRate > 0; }
 
-	void UpdateKCP();
-	void SendHeartbeat();
-	void HandleSocketRecv();
-	void SendReadyPass(const TSharedRef<FInternetAddr>& SourceAddr);
-	void RedirectConnection(const FRedNetworkPass& SourcePass, const TSharedRef<FInternetAddr>& SourceAddr);
-	void RegisterConnection(const FRedNetworkPass& SourcePass, const TSharedRef<FInternetAddr>& SourceAddr);
-	void HandleKCPRecv();
-	void HandleExpiredReadyPass();
-	void HandleExpiredConnection();
+	void SendPacedDatagrams(FShard& Shard);
+	int64 GetConnectionPacingRate(FConnectionInfo& Info) const;
 
-	void EnsureChannelCreated(int32 ClientID, uint8 Channel);
+	bool CreateShardSocket(FShard& Shard);
+	void StartShardThread(FShard& Shard);
+	void StopShardThread(FShard& Shard);
 
 public:
 
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Dense slot map: values live contiguously for iteration, handles are (slot index, generation) pairs.
+ * A slot can be reserved before it holds a value, and releasing it bumps the generation so stale handles miss.
+ */
+template <typename ValueType>
+class TRedNetworkSlotMap
+{
+public:
+
+	void SetLimits(int32 InMaxSlots, uint32 InMaxGeneration)
+	{
+		MaxSlots = InMaxSlots;
+		MaxGeneration = FMath::Max<uint32>(InMaxGeneration, 1);
+	}
+
+	/** Returns INDEX_NONE when every slot is taken. */
+	int32 Reserve(uint32& OutGeneration)
+	{
+		int32 SlotIndex;
+
+		if (FreeSlots.Num() > 0)
+		{
+			SlotIndex = FreeSlots.Pop(false);
+		}
+		else if (Slots.Num() < MaxSlots)
+		{
+			SlotIndex = Slots.AddDefaulted();
+		}
+		else
+		{
+			return INDEX_NONE;
+		}
+
+		FSlot& Slot = Slots[SlotIndex];
+		Slot.bReserved = true;
+		Slot.ValueIndex = INDEX_NONE;
+
+		OutGeneration = Slot.Generation;
+
+		return SlotIndex;
+	}
+
+	/** Gives a reserved slot its value. */
+	ValueType* Emplace(int32 SlotIndex, uint32 Generation, ValueType&& Value)
+	{
+		if (!IsReserved(SlotIndex, Generation) || Slots[SlotIndex].ValueIndex != INDEX_NONE) return nullptr;
+
+		Slots[SlotIndex].ValueIndex = Values.Add(MoveTemp(Value));
+		ValueSlots.Add(SlotIndex);
+
+		return &Values.Last();
+	}
+
+	void Release(int32 SlotIndex, uint32 Generation)
+	{
+		if (!IsReserved(SlotIndex, Generation)) return;
+
+		FSlot& Slot = Slots[SlotIndex];
+
+		if (Slot.ValueIndex != INDEX_NONE)
+		{
+			const int32 ValueIndex = Slot.ValueIndex;
+
+			// Swap the last value into the hole so values stay dense
+			Values.RemoveAtSwap(ValueIndex, 1, false);
+			ValueSlots.RemoveAtSwap(ValueIndex, 1, false);
+
+			if (ValueIndex < Values.Num()) Slots[ValueSlots[ValueIndex]].ValueIndex = ValueIndex;
+		}
+
+		Slot.bReserved = false;
+		Slot.ValueIndex = INDEX_NONE;
+		Slot.Generation = Slot.Generation % MaxGeneration + 1;
+
+		FreeSlots.Add(SlotIndex);
+	}
+
+	ValueType* Find(int32 SlotIndex, uint32 Generation)
+	{
+		if (!IsReserved(SlotIndex, Generation) || Slots[SlotIndex].ValueIndex == INDEX_NONE) return nullptr;
+
+		return &Values[Slots[SlotIndex].ValueIndex];
+	}
+
+	bool IsReserved(int32 SlotIndex, uint32 Generation) const
+	{
+		return Slots.IsValidIndex(SlotIndex) && Slots[SlotIndex].bReserved && Slots[SlotIndex].Generation == Generation;
+	}
+
+	/** Values in dense order, Release swaps the last one into the freed position. */
+	TArray<ValueType>& GetValues() { return Values; }
+	const TArray<ValueType>& GetValues() const { return Values; }
+
+	int32 Num() const { return Values.Num(); }
+
+	void Reset()
+	{
+		Slots.Reset();
+		FreeSlots.Reset();
+		Values.Reset();
+		ValueSlots.Reset();
+	}
+
+private:
+
+	struct FSlot
+	{
+		uint32 Generation = 1;
+		int32 ValueIndex = INDEX_NONE;
+		bool bReserved = false;
+	};
+
+	int32 MaxSlots = MAX_int32;
+	uint32 MaxGeneration = MAX_uint32;
+
+	TArray<FSlot> Slots;
+	TArray<int32> FreeSlots;
+
+	TArray<ValueType> Values;
+	TArray<int32> ValueSlots;
+
+};
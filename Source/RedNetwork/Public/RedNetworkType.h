@@ -1,6 +1,12 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "RedNetworkBuffer.h"
+#include "RedNetworkType.generated.h"
+
+class FKCPWrap;
+class FInternetAddr;
+class FRedNetworkFEC;
 
 struct REDNETWORK_API FRedNetworkPass
 {
@@ -18,3 +24,291 @@ struct REDNETWORK_API FRedNetworkPass
 
 	bool IsValid() const;
 };
+
+/** After the pass a datagram holds records, each a channel byte, a little-endian uint16 length and that many KCP bytes, or message bytes on an unreliable channel. */
+struct REDNETWORK_API FRedNetworkRecord
+{
+	static constexpr int32 HeaderSize = 3;
+
+	/** Pass plus one record header, reserved in front of KCP output so a lone record is framed in place. */
+	static constexpr int32 FrameSize = 8 + HeaderSize;
+
+	/** Records of one connection are packed up to this size, a single larger record still goes out alone. */
+	static constexpr int32 MaxDatagramSize = 1472;
+
+	/** Unreliable messages are never fragmented, each must fit one datagram behind its frame. */
+	static constexpr int32 MaxUnreliableSize = MaxDatagramSize - FrameSize;
+
+	uint8 Channel;
+	const uint8* Data;
+	int32 Count;
+
+	static void WriteHeader(uint8* Dest, uint8 Channel, int32 Count);
+
+	/** Appends a record header and returns where to write its Count bytes. */
+	static uint8* AppendUninitialized(TArray<uint8>& Buffer, uint8 Channel, int32 Count);
+
+	/** Reads the record at Offset and advances past it, false once the datagram is exhausted or truncated. */
+	bool Read(const uint8* Datagram, int32 DatagramCount, int32& Offset);
+};
+
+/** Per channel state of an unreliable-sequenced stream, every message is led by a little-endian uint16 sequence. */
+struct REDNETWORK_API FRedNetworkSequence
+{
+	static constexpr int32 HeaderSize = 2;
+
+	static constexpr int32 MaxMessageSize = FRedNetworkRecord::MaxUnreliableSize - HeaderSize;
+
+	uint16 NextSend = 0;
+	uint16 LastRecv = 0;
+	bool bHasRecv = false;
+
+	/** Writes the next send sequence to Dest. */
+	void WriteNext(uint8* Dest);
+
+	/** True when the sequence at Data is newer than every one accepted so far, it then becomes the newest. */
+	bool Accept(const uint8* Data);
+};
+
+/** Token bucket in bytes per second over the millisecond KCP clock, a datagram may leave while any token is left and the debt is paid after. */
+struct REDNETWORK_API FRedNetworkPacer
+{
+	/** Bytes per second, 0 is unlimited. */
+	int64 Rate = 0;
+	int64 Tokens = 0;
+	uint32 Time = 0;
+	bool bStarted = false;
+
+	void Refill(uint32 Now, int64 InRate, int64 Burst);
+
+	bool CanSend() const { return Rate <= 0 || Tokens > 0; }
+
+	void Spend(int32 Count) { if (Rate > 0) Tokens -= Count; }
+
+	/** What the unit can deliver, the controller's pacing rate when it has one, else its usable window over smoothed RTT with a quarter of headroom. */
+	static int64 EstimateRate(FKCPWrap& KCPUnit);
+
+	/** Estimate capped by Rate when both are set, else whichever is. */
+	static int64 CapRate(int64 Rate, int64 Estimate);
+};
+
+enum class ERedNetworkEvent : uint8
+{
+	Login,
+	Recv,
+	Unlogin,
+	Writable,
+};
+
+struct FRedNetworkEvent
+{
+	ERedNetworkEvent Type;
+	int32 ClientID;
+	uint8 Channel;
+	FRedNetworkMessage Message;
+};
+
+/** Messages drained by PollMessages, payloads are packed back to back in Arena. */
+struct REDNETWORK_API FRedNetworkMessageBatch
+{
+	struct FEntry
+	{
+		int32 ClientID;
+		uint8 Channel;
+		int32 Offset;
+		int32 Count;
+	};
+
+	TArray<uint8> Arena;
+	TArray<FEntry> Entries;
+
+	TArrayView<const uint8> GetData(const FEntry& Entry) const { return TArrayView<const uint8>(Arena.GetData() + Entry.Offset, Entry.Count); }
+
+	int32 Num() const { return Entries.Num(); }
+
+	/** Keeps the capacity. */
+	void Reset();
+
+	/** Adds an entry of Count uninitialized bytes and returns where to write them. */
+	uint8* Add(int32 ClientID, uint8 Channel, int32 Count);
+
+	/** Drops the last entry, for a receive that failed after Add. */
+	void Pop();
+
+	/** Appends every entry of Other, or swaps storage with it when this batch is empty, Reset Other before reusing it. */
+	void Append(FRedNetworkMessageBatch& Other);
+};
+
+/** Compact binary address + port, IPv4 is held in its IPv6-mapped form. */
+struct REDNETWORK_API FRedNetworkEndpoint
+{
+	uint32 Words[4];
+	uint16 Port;
+
+	FRedNetworkEndpoint();
+	explicit FRedNetworkEndpoint(const FInternetAddr& Addr);
+
+	static FRedNetworkEndpoint FromIPv4(uint32 Ip, uint16 Port);
+
+	FString ToString() const;
+
+	/** Allocates, keep the result instead of converting per packet. */
+	TSharedRef<FInternetAddr> ToInternetAddr() const;
+
+	bool operator==(const FRedNetworkEndpoint& Other) const
+	{
+		return Port == Other.Port
+			&& Words[3] == Other.Words[3] && Words[2] == Other.Words[2]
+			&& Words[1] == Other.Words[1] && Words[0] == Other.Words[0];
+	}
+
+	bool operator!=(const FRedNetworkEndpoint& Other) const { return !(*this == Other); }
+
+	friend uint32 GetTypeHash(const FRedNetworkEndpoint& Endpoint)
+	{
+		return HashCombine(Endpoint.Words[3] ^ Endpoint.Words[0], (Endpoint.Words[2] ^ Endpoint.Words[1]) + ((uint32)Endpoint.Port << 16));
+	}
+};
+
+struct FRedNetworkDatagram
+{
+	const uint8* Data;
+	int32 Count;
+	FRedNetworkEndpoint Endpoint;
+};
+
+UENUM(BlueprintType)
+enum class ERedNetworkSocketBackend : uint8
+{
+	/** One FSocket call per datagram, available on every platform. */
+	Generic,
+
+	/** recvmmsg/sendmmsg batches on Linux, IPv4 only, falls back to Generic elsewhere. */
+	Batched,
+
+	/** io_uring multishot receive and batched send submission on Linux, IPv4 only, falls back to Batched without kernel support. */
+	IoUring,
+};
+
+UENUM(BlueprintType)
+enum class ERedNetworkOverflowPolicy : uint8
+{
+	/** Send fails and the new message is discarded. */
+	Reject,
+
+	/** Unsent messages are discarded oldest first to make room, messages partly in flight are kept whole. */
+	DropOldest,
+};
+
+UENUM(BlueprintType)
+enum class ERedNetworkCongestionControl : uint8
+{
+	/** KCP's own loss-based window, or none with bNoCongestionWindow. */
+	Default,
+
+	/** Delay-based after BBR, keeps about one bandwidth-delay product in flight. Its pacing rate is used only with bEstimatePacingRate on the client or server. */
+	BBR,
+};
+
+/** KCP tuning of one reliable channel, the defaults are turbo mode. */
+USTRUCT(BlueprintType)
+struct REDNETWORK_API FRedNetworkChannelConfig
+{
+	GENERATED_BODY()
+
+	/** Resend on the first timeout instead of backing off, and shorten the minimum RTO. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	bool bNoDelay = true;
+
+	/** Milliseconds between internal flushes. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network", meta = (ClampMin = "10", ClampMax = "5000"))
+	int32 Interval = 10;
+
+	/** Resend once this many later segments are acked, 0 waits for the timeout. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network", meta = (ClampMin = "0"))
+	int32 FastResend = 2;
+
+	/** Ignore the congestion window and send up to the windows below, has no effect with a CongestionControl other than Default. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	bool bNoCongestionWindow = true;
+
+	/** Which controller owns the congestion window, BBR ignores bNoCongestionWindow. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	ERedNetworkCongestionControl CongestionControl = ERedNetworkCongestionControl::Default;
+
+	/** Segments in flight, bulk channels want this large. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network", meta = (ClampMin = "1"))
+	int32 SendWindow = 32;
+
+	/** Segments buffered for reordering, KCP keeps at least 128. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network", meta = (ClampMin = "128"))
+	int32 RecvWindow = 128;
+
+	/** Datagram size including the record frame, kept within FRedNetworkRecord::MaxDatagramSize. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network", meta = (ClampMin = "64", ClampMax = "1472"))
+	int32 MTU = 1400;
+
+	/** Byte stream instead of messages, sends are merged into full segments and boundaries are lost. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	bool bStreamMode = false;
+
+	/** Segments waiting in KCP per connection, queued and in flight, 0 is unbounded. Threaded server shards check it against the last published count, sends of one tick may overshoot it. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network", meta = (ClampMin = "0"))
+	int32 MaxWaitSent = 0;
+
+	/** What a send does once MaxWaitSent is reached. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	ERedNetworkOverflowPolicy OverflowPolicy = ERedNetworkOverflowPolicy::Reject;
+
+	/** Higher flushes first when the connection's byte budget runs short. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network")
+	int32 Priority = 0;
+
+	/** Share of the budget against channels of the same priority. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network", meta = (ClampMin = "1"))
+	int32 Weight = 1;
+
+	/** Packets per forward error correction group, 0 disables it. Both ends must agree. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network", meta = (ClampMin = "0", ClampMax = "64"))
+	int32 FECDataShards = 0;
+
+	/** Parity packets per group, each rebuilds one loss among the packets it covers. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Red|Network", meta = (ClampMin = "1", ClampMax = "16"))
+	int32 FECParityShards = 1;
+
+	/** Room to pass to FKCPWrap::SetReserved, the record frame plus the FEC header when enabled. */
+	int32 GetReservedSize() const;
+
+	/** Null without FEC. */
+	TSharedPtr<FRedNetworkFEC> CreateFEC() const;
+
+	/** Call after FKCPWrap::SetReserved, the MTU is counted with the reserved room. */
+	void Apply(FKCPWrap& KCPUnit) const;
+
+	/** Checks MaxWaitSent before sending Count bytes, false when the send must be refused. bOutOverflowed tells whether the cap was hit.
+	 * Without bMayRefuse the send always goes through, for sends already reported as accepted to the caller. */
+	bool Admit(FKCPWrap& KCPUnit, int32 Count, bool& bOutOverflowed, bool bMayRefuse = true) const;
+
+	/** An overflowed channel is writable again once it drains to half of MaxWaitSent. */
+	bool IsWritable(const FKCPWrap& KCPUnit) const;
+};
+
+/** Channel properties of a client or server, copied on Activate so they stay fixed while network threads read them. */
+struct REDNETWORK_API FRedNetworkChannelSettings
+{
+	TSet<uint8> UnreliableChannels;
+	TSet<uint8> SequencedChannels;
+	TMap<uint8, FRedNetworkChannelConfig> ChannelConfigs;
+	FRedNetworkChannelConfig DefaultChannelConfig;
+
+	bool IsUnreliableChannel(uint8 Channel) const { return UnreliableChannels.Contains(Channel) || SequencedChannels.Contains(Channel); }
+	bool IsSequencedChannel(uint8 Channel) const { return SequencedChannels.Contains(Channel); }
+
+	const FRedNetworkChannelConfig& GetChannelConfig(uint8 Channel) const
+	{
+		const FRedNetworkChannelConfig* Config = ChannelConfigs.Find(Channel);
+		return Config ? *Config : DefaultChannelConfig;
+	}
+
+	int32 GetMaxUnreliableSize(uint8 Channel) const { return IsSequencedChannel(Channel) ? FRedNetworkSequence::MaxMessageSize : FRedNetworkRecord::MaxUnreliableSize; }
+};
@@ -0,0 +1,309 @@
+#include "KCPAllocator.h"
+
+#include "ikcp.h"
+#include "Logging.h"
+#include "HAL/PlatformTLS.h"
+#include "Misc/ScopeLock.h"
+
+namespace FKCPAllocatorImpl
+{
+	/** Segments are sizeof(IKCPSEG) + MSS, the 1536 class fits the default 1400 byte MTU with little waste. */
+	constexpr SIZE_T ClassSizes[] = { 64, 128, 256, 512, 1024, 1536, 2048, 4096, 8192 };
+	constexpr int32 NumClasses = UE_ARRAY_COUNT(ClassSizes);
+
+	constexpr SIZE_T HeaderSize = 16;
+
+	/** A full thread cache hands half of a class to the shared pool, an empty one takes up to a refill batch back. */
+	constexpr int32 MaxThreadBlocks = 256;
+	constexpr int32 RefillBlocks = 32;
+
+	/** Beyond this a shared pool returns blocks to the system. */
+	constexpr int32 MaxSharedBlocks = 4096;
+
+	struct FHeader
+	{
+		int32 ClassIndex;
+		uint32 Padding;
+		SIZE_T Size;
+	};
+
+	static_assert(sizeof(FHeader) <= HeaderSize, "KCP allocator header must fit in front of the block.");
+
+	/** Free blocks link through their header, it is rewritten when the block is handed out again. */
+	struct FFreeBlock
+	{
+		FFreeBlock* Next;
+	};
+
+	struct FFreeList
+	{
+		FFreeBlock* Head = nullptr;
+		int32 Num = 0;
+
+		void Push(FFreeBlock* Block)
+		{
+			Block->Next = Head;
+			Head = Block;
+			++Num;
+		}
+
+		FFreeBlock* Pop()
+		{
+			FFreeBlock* Block = Head;
+			Head = Block->Next;
+			--Num;
+			return Block;
+		}
+	};
+
+	struct FThreadCache
+	{
+		FFreeList Lists[NumClasses];
+
+		TAtomic<uint64> Hits { 0 };
+		TAtomic<uint64> Misses { 0 };
+	};
+
+	struct FSharedPool
+	{
+		FCriticalSection Lock;
+		FFreeList List;
+	};
+
+	uint32 TlsSlot = FPlatformTLS::InvalidTlsSlot;
+
+	FSharedPool SharedPools[NumClasses];
+
+	FCriticalSection CachesLock;
+	TArray<FThreadCache*> Caches;
+
+	/** Counters of released caches, guarded by CachesLock. */
+	uint64 ReleasedHits = 0;
+	uint64 ReleasedMisses = 0;
+
+	TAtomic<uint64> CurrentBytes { 0 };
+	TAtomic<uint64> PeakBytes { 0 };
+
+	int32 FindClass(SIZE_T Size)
+	{
+		for (int32 Index = 0; Index < NumClasses; ++Index)
+		{
+			if (Size <= ClassSizes[Index]) return Index;
+		}
+
+		return INDEX_NONE;
+	}
+
+	FThreadCache& GetThreadCache()
+	{
+		FThreadCache* Cache = (FThreadCache*)FPlatformTLS::GetTlsValue(TlsSlot);
+
+		if (Cache) return *Cache;
+
+		Cache = new FThreadCache();
+		FPlatformTLS::SetTlsValue(TlsSlot, Cache);
+
+		FScopeLock ScopeLock(&CachesLock);
+		Caches.Add(Cache);
+
+		return *Cache;
+	}
+
+	void Count(TAtomic<uint64>& Counter)
+	{
+		// Only the owning thread writes its counters
+		Counter.Store(Counter.Load(EMemoryOrder::Relaxed) + 1, EMemoryOrder::Relaxed);
+	}
+
+	void* SystemMalloc(SIZE_T Size)
+	{
+		const uint64 NewBytes = (CurrentBytes += Size);
+
+		uint64 Peak = PeakBytes.Load(EMemoryOrder::Relaxed);
+		while (NewBytes > Peak && !PeakBytes.CompareExchange(Peak, NewBytes));
+
+		return FMemory::Malloc(Size, HeaderSize);
+	}
+
+	void SystemFree(void* Block, SIZE_T Size)
+	{
+		CurrentBytes -= Size;
+
+		FMemory::Free(Block);
+	}
+
+	void* ToUser(void* Block, int32 ClassIndex, SIZE_T Size)
+	{
+		FHeader* Header = (FHeader*)Block;
+		Header->ClassIndex = ClassIndex;
+		Header->Size = Size;
+
+		return (uint8*)Block + HeaderSize;
+	}
+}
+
+void FKCPAllocator::Install()
+{
+	using namespace FKCPAllocatorImpl;
+
+	if (TlsSlot != FPlatformTLS::InvalidTlsSlot) return;
+
+	TlsSlot = FPlatformTLS::AllocTlsSlot();
+
+	ikcp_allocator(&FKCPAllocator::Malloc, &FKCPAllocator::Free);
+
+	UE_LOG(LogKCP, Log, TEXT("KCP pooled allocator installed."));
+}
+
+void FKCPAllocator::LogStats()
+{
+	const FKCPAllocatorStats Stats = GetStats();
+
+	UE_LOG(LogKCP, Log, TEXT("KCP pooled allocator %llu hits, %llu misses, %llu current bytes, %llu peak bytes."), Stats.Hits, Stats.Misses, Stats.CurrentBytes, Stats.PeakBytes);
+}
+
+FKCPAllocatorStats FKCPAllocator::GetStats()
+{
+	using namespace FKCPAllocatorImpl;
+
+	FKCPAllocatorStats Stats;
+
+	{
+		FScopeLock ScopeLock(&CachesLock);
+
+		Stats.Hits = ReleasedHits;
+		Stats.Misses = ReleasedMisses;
+
+		for (const FThreadCache* Cache : Caches)
+		{
+			Stats.Hits += Cache->Hits.Load(EMemoryOrder::Relaxed);
+			Stats.Misses += Cache->Misses.Load(EMemoryOrder::Relaxed);
+		}
+	}
+
+	Stats.CurrentBytes = CurrentBytes.Load(EMemoryOrder::Relaxed);
+	Stats.PeakBytes = PeakBytes.Load(EMemoryOrder::Relaxed);
+
+	return Stats;
+}
+
+void FKCPAllocator::ReleaseThreadCache()
+{
+	using namespace FKCPAllocatorImpl;
+
+	if (TlsSlot == FPlatformTLS::InvalidTlsSlot) return;
+
+	FThreadCache* Cache = (FThreadCache*)FPlatformTLS::GetTlsValue(TlsSlot);
+
+	if (!Cache) return;
+
+	for (int32 ClassIndex = 0; ClassIndex < NumClasses; ++ClassIndex)
+	{
+		FFreeList& List = Cache->Lists[ClassIndex];
+
+		if (List.Num == 0) continue;
+
+		FSharedPool& Pool = SharedPools[ClassIndex];
+
+		FScopeLock ScopeLock(&Pool.Lock);
+
+		while (List.Num > 0)
+		{
+			FFreeBlock* Block = List.Pop();
+
+			if (Pool.List.Num < MaxSharedBlocks) Pool.List.Push(Block);
+			else SystemFree(Block, ClassSizes[ClassIndex]);
+		}
+	}
+
+	{
+		FScopeLock ScopeLock(&CachesLock);
+
+		ReleasedHits += Cache->Hits.Load(EMemoryOrder::Relaxed);
+		ReleasedMisses += Cache->Misses.Load(EMemoryOrder::Relaxed);
+
+		Caches.RemoveSwap(Cache);
+	}
+
+	FPlatformTLS::SetTlsValue(TlsSlot, nullptr);
+
+	delete Cache;
+}
+
+void* FKCPAllocator::Malloc(size_t Size)
+{
+	using namespace FKCPAllocatorImpl;
+
+	FThreadCache& Cache = GetThreadCache();
+
+	const SIZE_T BlockSize = Size + HeaderSize;
+	const int32 ClassIndex = FindClass(BlockSize);
+
+	if (ClassIndex == INDEX_NONE)
+	{
+		Count(Cache.Misses);
+
+		return ToUser(SystemMalloc(BlockSize), INDEX_NONE, BlockSize);
+	}
+
+	FFreeList& List = Cache.Lists[ClassIndex];
+
+	if (List.Num == 0)
+	{
+		FSharedPool& Pool = SharedPools[ClassIndex];
+
+		FScopeLock ScopeLock(&Pool.Lock);
+
+		for (int32 Index = 0; Index < RefillBlocks && Pool.List.Num > 0; ++Index)
+		{
+			List.Push(Pool.List.Pop());
+		}
+	}
+
+	if (List.Num == 0)
+	{
+		Count(Cache.Misses);
+
+		return ToUser(SystemMalloc(ClassSizes[ClassIndex]), ClassIndex, ClassSizes[ClassIndex]);
+	}
+
+	Count(Cache.Hits);
+
+	return ToUser(List.Pop(), ClassIndex, ClassSizes[ClassIndex]);
+}
+
+void FKCPAllocator::Free(void* Ptr)
+{
+	using namespace FKCPAllocatorImpl;
+
+	if (!Ptr) return;
+
+	void* Block = (uint8*)Ptr - HeaderSize;
+	const FHeader* Header = (const FHeader*)Block;
+
+	if (Header->ClassIndex == INDEX_NONE)
+	{
+		SystemFree(Block, Header->Size);
+		return;
+	}
+
+	const int32 ClassIndex = Header->ClassIndex;
+
+	FFreeList& List = GetThreadCache().Lists[ClassIndex];
+
+	List.Push((FFreeBlock*)Block);
+
+	if (List.Num <= MaxThreadBlocks) return;
+
+	FSharedPool& Pool = SharedPools[ClassIndex];
+
+	FScopeLock ScopeLock(&Pool.Lock);
+
+	while (List.Num > MaxThreadBlocks / 2)
+	{
+		FFreeBlock* Spill = List.Pop();
+
+		if (Pool.List.Num < MaxSharedBlocks) Pool.List.Push(Spill);
+		else SystemFree(Spill, ClassSizes[ClassIndex]);
+	}
+}
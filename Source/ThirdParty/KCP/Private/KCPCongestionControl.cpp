@@ -0,0 +1,193 @@
+#include "KCPCongestionControl.h"
+
+namespace FKCPBBRControlImpl
+{
+	/** 2/ln2, the smallest gain that still doubles delivery every round. */
+	constexpr int32 HighGain = 2885;
+	constexpr int32 DrainGain = 1000 * 1000 / HighGain;
+	constexpr int32 ProbeWindowGain = 2000;
+
+	constexpr int32 CycleGains[] = { 1250, 750, 1000, 1000, 1000, 1000, 1000, 1000 };
+	constexpr int32 NumCycleGains = UE_ARRAY_COUNT(CycleGains);
+
+	/** A minimum RTT this old is probed again by draining the pipe. */
+	constexpr int32 MinRTTExpiry = 10000;
+	constexpr int32 ProbeRTTTime = 200;
+
+	/** Bandwidth must grow by a quarter within this many rounds or the pipe counts as full. */
+	constexpr int32 FullBandwidthRounds = 3;
+
+	/** Before any RTT sample. */
+	constexpr int32 InitialRTT = 100;
+}
+
+void FKCPBBRControl::OnAttach(ikcpcb& KCPCB)
+{
+	KCPCB.cwnd = FMath::Max<IUINT32>(KCPCB.cwnd, MinWindow);
+
+	RoundStart = KCPCB.current;
+	MinRTTStamp = KCPCB.current;
+}
+
+void FKCPBBRControl::OnRTTSample(ikcpcb& KCPCB, int32 RTT)
+{
+	using namespace FKCPBBRControlImpl;
+
+	RTT = FMath::Max(RTT, 1);
+
+	if (State == EState::ProbeRTT)
+	{
+		ProbeMinRTT = FMath::Min(ProbeMinRTT, RTT);
+		return;
+	}
+
+	if (RTT <= MinRTT)
+	{
+		MinRTT = RTT;
+		MinRTTStamp = KCPCB.current;
+		return;
+	}
+
+	if ((int32)(KCPCB.current - MinRTTStamp) > MinRTTExpiry)
+	{
+		EnterState(EState::ProbeRTT);
+
+		ProbeMinRTT = RTT;
+		ProbeRTTDone = KCPCB.current + FMath::Max(ProbeRTTTime, GetRoundTime());
+	}
+}
+
+void FKCPBBRControl::OnAck(ikcpcb& KCPCB, int32 AckedSegments)
+{
+	RoundDelivered += (int64)AckedSegments * KCPCB.mss;
+
+	if ((int32)(KCPCB.current - RoundStart) >= GetRoundTime()) EndRound(KCPCB);
+
+	if (State == EState::Drain && (int64)(KCPCB.snd_nxt - KCPCB.snd_una) <= GetBDPSegments(KCPCB))
+	{
+		EnterState(EState::ProbeBW);
+	}
+
+	if (State == EState::ProbeRTT && (int32)(KCPCB.current - ProbeRTTDone) >= 0)
+	{
+		MinRTT = ProbeMinRTT;
+		MinRTTStamp = KCPCB.current;
+
+		EnterState(bFullBandwidth ? EState::ProbeBW : EState::Startup);
+	}
+
+	UpdateWindow(KCPCB, AckedSegments);
+}
+
+void FKCPBBRControl::OnLoss(ikcpcb& KCPCB, int32 InFlight, bool bTimeout)
+{
+	// Loss alone says little about the path, only a timeout means the model is off
+	if (!bTimeout) return;
+
+	KCPCB.cwnd = FMath::Max<IUINT32>(MinWindow, FMath::Min<IUINT32>(KCPCB.cwnd, InFlight) / 2);
+}
+
+int64 FKCPBBRControl::GetPacingRate() const
+{
+	return Bandwidth * PacingGain / 1000;
+}
+
+int32 FKCPBBRControl::GetRoundTime() const
+{
+	return MinRTT == MAX_int32 ? FKCPBBRControlImpl::InitialRTT : MinRTT;
+}
+
+int64 FKCPBBRControl::GetBDPSegments(const ikcpcb& KCPCB) const
+{
+	return Bandwidth * GetRoundTime() / 1000 / FMath::Max<int64>(KCPCB.mss, 1);
+}
+
+void FKCPBBRControl::EndRound(ikcpcb& KCPCB)
+{
+	using namespace FKCPBBRControlImpl;
+
+	const int32 Elapsed = FMath::Max((int32)(KCPCB.current - RoundStart), 1);
+
+	BandwidthSamples[Round % BandwidthWindow] = RoundDelivered * 1000 / Elapsed;
+
+	++Round;
+	RoundStart = KCPCB.current;
+	RoundDelivered = 0;
+
+	// The slot of the next round is the oldest, it leaves the filter
+	BandwidthSamples[Round % BandwidthWindow] = 0;
+
+	Bandwidth = 0;
+
+	for (int64 Sample : BandwidthSamples)
+	{
+		Bandwidth = FMath::Max(Bandwidth, Sample);
+	}
+
+	if (!bFullBandwidth)
+	{
+		if (Bandwidth >= FullBandwidth * 5 / 4)
+		{
+			FullBandwidth = Bandwidth;
+			FullBandwidthRounds = 0;
+		}
+		else if (++FullBandwidthRounds >= FKCPBBRControlImpl::FullBandwidthRounds)
+		{
+			bFullBandwidth = true;
+		}
+	}
+
+	if (State == EState::Startup && bFullBandwidth) EnterState(EState::Drain);
+
+	if (State == EState::ProbeBW)
+	{
+		CycleIndex = (CycleIndex + 1) % NumCycleGains;
+		PacingGain = CycleGains[CycleIndex];
+	}
+}
+
+void FKCPBBRControl::EnterState(EState NewState)
+{
+	using namespace FKCPBBRControlImpl;
+
+	State = NewState;
+
+	switch (State)
+	{
+	case EState::Startup:
+		PacingGain = HighGain;
+		WindowGain = HighGain;
+		break;
+	case EState::Drain:
+		PacingGain = DrainGain;
+		WindowGain = HighGain;
+		break;
+	case EState::ProbeBW:
+		CycleIndex = 0;
+		PacingGain = CycleGains[CycleIndex];
+		WindowGain = ProbeWindowGain;
+		break;
+	case EState::ProbeRTT:
+		PacingGain = 1000;
+		WindowGain = 1000;
+		break;
+	}
+}
+
+void FKCPBBRControl::UpdateWindow(ikcpcb& KCPCB, int32 AckedSegments)
+{
+	if (State == EState::ProbeRTT)
+	{
+		KCPCB.cwnd = MinWindow;
+		return;
+	}
+
+	const int64 Target = FMath::Max<int64>(GetBDPSegments(KCPCB) * WindowGain / 1000, MinWindow);
+
+	// Grow by what was delivered, until the pipe is known to be full the target is not trusted
+	int64 Window = (int64)KCPCB.cwnd + AckedSegments;
+
+	if (bFullBandwidth) Window = FMath::Min(Window, Target);
+
+	KCPCB.cwnd = (IUINT32)FMath::Clamp<int64>(Window, MinWindow, MAX_int32);
+}
@@ -1,13 +1,14 @@
 #include "CoreMinimal.h"
 #include "Modules/ModuleManager.h"
+#include "KCPAllocator.h"
 
 class KCP_API FKCPModule : public IModuleInterface
 {
 public:
 
 	// ~Begin IModuleInterface Interface 
-	virtual void StartupModule() override { }
-	virtual void ShutdownModule() override { }
+	virtual void StartupModule() override { FKCPAllocator::Install(); }
+	virtual void ShutdownModule() override { FKCPAllocator::LogStats(); }
 	// ~End IModuleInterface Interface 
 
 };
@@ -1,13 +1,15 @@
 #include "KCPWrap.h"
 
 #include "Logging.h"
+#include "KCPCongestionControl.h"
 
 namespace FKCPFuncWrap
 {
 	int Output(const char* buf, int len, ikcpcb* kcp, void* user)
 	{
 		FKCPWrap* KCPWrap = (FKCPWrap*)user;
-		if (KCPWrap->OutputFunc) return KCPWrap->OutputFunc((const uint8*)buf, len);
+		// buf is kcp->buffer, the reserved room at its front is ours to write
+		if (KCPWrap->OutputFunc) return KCPWrap->OutputFunc((uint8*)buf, len);
 		return 0;
 	}
 
@@ -16,6 +18,21 @@ namespace FKCPFuncWrap
 		FKCPWrap* KCPWrap = (FKCPWrap*)user;
 		UE_LOG(LogKCP, Log, TEXT("%s: %s"), *KCPWrap->GetDebugName(), ANSI_TO_TCHAR(log));
 	}
+
+	void Congestion(ikcpcb* kcp, int event, IINT32 value, void* user)
+	{
+		IKCPCongestionControl* Control = ((FKCPWrap*)user)->GetCongestionControl();
+
+		if (!Control) return;
+
+		switch (event)
+		{
+		case IKCP_CC_RTT:        Control->OnRTTSample(*kcp, value);    break;
+		case IKCP_CC_ACK:        Control->OnAck(*kcp, value);          break;
+		case IKCP_CC_FASTRESEND: Control->OnLoss(*kcp, value, false);  break;
+		case IKCP_CC_TIMEOUT:    Control->OnLoss(*kcp, value, true);   break;
+		}
+	}
 }
 
 FKCPWrap::FKCPWrap(uint32 Conv)
@@ -37,6 +54,11 @@ FKCPWrap::~FKCPWrap()
 	ikcp_release(KCPPtr);
 }
 
+uint32 FKCPWrap::Clock()
+{
+	return (uint32)(uint64)(FPlatformTime::Seconds() * 1000.0);
+}
+
 ikcpcb & FKCPWrap::GetKCPCB()
 {
 	return *KCPPtr;
@@ -57,9 +79,19 @@ void FKCPWrap::Update(uint32 Current)
 	ikcp_update(KCPPtr, Current);
 }
 
-void FKCPWrap::Check(uint32 Current) const
+void FKCPWrap::Update(uint32 Current, int32 MaxNewSegments)
+{
+	// Limits the queue move only, snd_wnd stays as is for the congestion window that is computed from it
+	KCPPtr->newlimit = FMath::Max(MaxNewSegments, 0);
+
+	ikcp_update(KCPPtr, Current);
+
+	KCPPtr->newlimit = -1;
+}
+
+uint32 FKCPWrap::Check(uint32 Current) const
 {
-	ikcp_check(KCPPtr, Current);
+	return ikcp_check(KCPPtr, Current);
 }
 
 int FKCPWrap::Input(const uint8 * Data, int32 Count)
@@ -82,6 +114,11 @@ int FKCPWrap::SetMTU(int32 MTU)
 	return ikcp_setmtu(KCPPtr, MTU);
 }
 
+int FKCPWrap::SetReserved(int32 Reserved)
+{
+	return ikcp_reserve(KCPPtr, Reserved);
+}
+
 int FKCPWrap::SetWindowSize(int32 SentWindow, int32 RecvWindow)
 {
 	return ikcp_wndsize(KCPPtr, SentWindow, RecvWindow);
@@ -92,6 +129,16 @@ int FKCPWrap::GetWaitSent() const
 	return ikcp_waitsnd(KCPPtr);
 }
 
+bool FKCPWrap::IsIdle() const
+{
+	return KCPPtr->nsnd_buf == 0 && KCPPtr->nsnd_que == 0 && KCPPtr->ackcount == 0 && KCPPtr->probe == 0;
+}
+
+int FKCPWrap::DropSendQueue(int32 Count)
+{
+	return ikcp_dropsnd(KCPPtr, Count);
+}
+
 int FKCPWrap::SetNoDelay(int32 NoDelay, int32 Internal, int32 FastResend, int32 NC)
 {
 	return ikcp_nodelay(KCPPtr, NoDelay, Internal, FastResend, NC);
@@ -107,6 +154,15 @@ int FKCPWrap::SetTurboMode()
 	return SetNoDelay(1, 10, 2, 1);
 }
 
+void FKCPWrap::SetCongestionControl(TSharedPtr<IKCPCongestionControl> Control)
+{
+	CongestionControl = Control;
+
+	KCPPtr->congestion = CongestionControl ? &FKCPFuncWrap::Congestion : nullptr;
+
+	if (CongestionControl) CongestionControl->OnAttach(*KCPPtr);
+}
+
 void FKCPWrap::SetDebugName(const FString & InDebugName)
 {
 	DebugName = InDebugName;
@@ -253,6 +253,7 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
 	kcp->mtu = IKCP_MTU_DEF;
 	kcp->mss = kcp->mtu - IKCP_OVERHEAD;
 	kcp->stream = 0;
+	kcp->reserved = 0;
 
 	kcp->buffer = (char*)ikcp_malloc((kcp->mtu + IKCP_OVERHEAD) * 3);
 	if (kcp->buffer == NULL) {
@@ -290,6 +291,8 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
 	kcp->dead_link = IKCP_DEADLINK;
 	kcp->output = NULL;
 	kcp->writelog = NULL;
+	kcp->congestion = NULL;
+	kcp->newlimit = -1;
 
 	return kcp;
 }
@@ -749,6 +752,7 @@ void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
 int ikcp_input(ikcpcb *kcp, const char *data, long size)
 {
 	IUINT32 prev_una = kcp->snd_una;
+	IUINT32 prev_nsnd_buf = kcp->nsnd_buf;
 	IUINT32 maxack = 0, latest_ts = 0;
 	int flag = 0;
 
@@ -792,6 +796,9 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 		if (cmd == IKCP_CMD_ACK) {
 			if (_itimediff(kcp->current, ts) >= 0) {
 				ikcp_update_ack(kcp, _itimediff(kcp->current, ts));
+				if (kcp->congestion) {
+					kcp->congestion(kcp, IKCP_CC_RTT, _itimediff(kcp->current, ts), kcp->user);
+				}
 			}
 			ikcp_parse_ack(kcp, sn);
 			ikcp_shrink_buf(kcp);
@@ -872,7 +879,12 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 		ikcp_parse_fastack(kcp, maxack, latest_ts);
 	}
 
-	if (_itimediff(kcp->snd_una, prev_una) > 0) {
+	if (kcp->congestion) {
+		if (prev_nsnd_buf > kcp->nsnd_buf) {
+			kcp->congestion(kcp, IKCP_CC_ACK, (IINT32)(prev_nsnd_buf - kcp->nsnd_buf), kcp->user);
+		}
+	}
+	else if (_itimediff(kcp->snd_una, prev_una) > 0) {
 		if (kcp->cwnd < kcp->rmt_wnd) {
 			IUINT32 mss = kcp->mss;
 			if (kcp->cwnd < kcp->ssthresh) {
@@ -932,7 +944,7 @@ void ikcp_flush(ikcpcb *kcp)
 {
 	IUINT32 current = kcp->current;
 	char *buffer = kcp->buffer;
-	char *ptr = buffer;
+	char *ptr = buffer + kcp->reserved;
 	int count, size, i;
 	IUINT32 resent, cwnd;
 	IUINT32 rtomin;
@@ -959,7 +971,7 @@ void ikcp_flush(ikcpcb *kcp)
 		size = (int)(ptr - buffer);
 		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
 			ikcp_output(kcp, buffer, size);
-			ptr = buffer;
+			ptr = buffer + kcp->reserved;
 		}
 		ikcp_ack_get(kcp, i, &seg.sn, &seg.ts);
 		ptr = ikcp_encode_seg(ptr, &seg);
@@ -995,7 +1007,7 @@ void ikcp_flush(ikcpcb *kcp)
 		size = (int)(ptr - buffer);
 		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
 			ikcp_output(kcp, buffer, size);
-			ptr = buffer;
+			ptr = buffer + kcp->reserved;
 		}
 		ptr = ikcp_encode_seg(ptr, &seg);
 	}
@@ -1006,7 +1018,7 @@ void ikcp_flush(ikcpcb *kcp)
 		size = (int)(ptr - buffer);
 		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
 			ikcp_output(kcp, buffer, size);
-			ptr = buffer;
+			ptr = buffer + kcp->reserved;
 		}
 		ptr = ikcp_encode_seg(ptr, &seg);
 	}
@@ -1015,12 +1027,14 @@ void ikcp_flush(ikcpcb *kcp)
 
 	// calculate window size
 	cwnd = _imin_(kcp->snd_wnd, kcp->rmt_wnd);
-	if (kcp->nocwnd == 0) cwnd = _imin_(kcp->cwnd, cwnd);
+	if (kcp->nocwnd == 0 || kcp->congestion) cwnd = _imin_(kcp->cwnd, cwnd);
 
 	// move data from snd_queue to snd_buf
 	while (_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0) {
 		IKCPSEG *newseg;
 		if (iqueue_is_empty(&kcp->snd_queue)) break;
+		if (kcp->newlimit == 0) break;
+		if (kcp->newlimit > 0) kcp->newlimit--;
 
 		newseg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
 
@@ -1091,7 +1105,7 @@ void ikcp_flush(ikcpcb *kcp)
 
 			if (size + need > (int)kcp->mtu) {
 				ikcp_output(kcp, buffer, size);
-				ptr = buffer;
+				ptr = buffer + kcp->reserved;
 			}
 
 			ptr = ikcp_encode_seg(ptr, segment);
@@ -1109,10 +1123,18 @@ void ikcp_flush(ikcpcb *kcp)
 
 	// flash remain segments
 	size = (int)(ptr - buffer);
-	if (size > 0) {
+	if (size > kcp->reserved) {
 		ikcp_output(kcp, buffer, size);
 	}
 
+	// an attached controller sets cwnd itself
+	if (kcp->congestion) {
+		IUINT32 inflight = kcp->snd_nxt - kcp->snd_una;
+		if (change) kcp->congestion(kcp, IKCP_CC_FASTRESEND, (IINT32)inflight, kcp->user);
+		if (lost) kcp->congestion(kcp, IKCP_CC_TIMEOUT, (IINT32)inflight, kcp->user);
+		change = lost = 0;
+	}
+
 	// update ssthresh
 	if (change) {
 		IUINT32 inflight = kcp->snd_nxt - kcp->snd_una;
@@ -1223,18 +1245,28 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
 int ikcp_setmtu(ikcpcb *kcp, int mtu)
 {
 	char *buffer;
-	if (mtu < 50 || mtu < (int)IKCP_OVERHEAD) 
+	if (mtu < 50 || mtu < (int)IKCP_OVERHEAD + kcp->reserved) 
 		return -1;
 	buffer = (char*)ikcp_malloc((mtu + IKCP_OVERHEAD) * 3);
 	if (buffer == NULL) 
 		return -2;
 	kcp->mtu = mtu;
-	kcp->mss = kcp->mtu - IKCP_OVERHEAD;
+	kcp->mss = kcp->mtu - IKCP_OVERHEAD - kcp->reserved;
 	ikcp_free(kcp->buffer);
 	kcp->buffer = buffer;
 	return 0;
 }
 
+// leave bytes in front of every output packet for the caller's own header
+int ikcp_reserve(ikcpcb *kcp, int reserved)
+{
+	if (reserved < 0 || reserved + (int)IKCP_OVERHEAD >= (int)kcp->mtu)
+		return -1;
+	kcp->reserved = reserved;
+	kcp->mss = kcp->mtu - IKCP_OVERHEAD - kcp->reserved;
+	return 0;
+}
+
 int ikcp_interval(ikcpcb *kcp, int interval)
 {
 	if (interval > 5000) interval = 5000;
@@ -1287,6 +1319,42 @@ int ikcp_waitsnd(const ikcpcb *kcp)
 	return kcp->nsnd_buf + kcp->nsnd_que;
 }
 
+// drop whole messages from the front of snd_queue until count segments are gone
+int ikcp_dropsnd(ikcpcb *kcp, int count)
+{
+	struct IQUEUEHEAD *p, *next;
+	int continuation = 0;
+	int dropping = 0;
+	int dropped = 0;
+
+	// the head may finish a message whose first fragments are in flight
+	if (!iqueue_is_empty(&kcp->snd_buf)) {
+		IKCPSEG *last = iqueue_entry(kcp->snd_buf.prev, IKCPSEG, node);
+		continuation = (last->frg != 0);
+	}
+
+	for (p = kcp->snd_queue.next; p != &kcp->snd_queue; p = next) {
+		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+		int final = (seg->frg == 0);
+		next = p->next;
+		if (continuation) {
+			continuation = !final;
+			continue;
+		}
+		if (!dropping) {
+			if (dropped >= count) break;
+			dropping = 1;
+		}
+		iqueue_del(&seg->node);
+		ikcp_segment_delete(kcp, seg);
+		kcp->nsnd_que--;
+		dropped++;
+		if (final) dropping = 0;
+	}
+
+	return dropped;
+}
+
 
 // read conv
 IUINT32 ikcp_getconv(const void *ptr)
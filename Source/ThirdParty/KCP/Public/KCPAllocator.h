@@ -0,0 +1,41 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+struct KCP_API FKCPAllocatorStats
+{
+	/** Allocations served from a thread cache or the shared pool. */
+	uint64 Hits = 0;
+
+	/** Allocations that went to the system allocator, oversized ones included. */
+	uint64 Misses = 0;
+
+	/** Bytes currently taken from the system, pooled blocks included. */
+	uint64 CurrentBytes = 0;
+
+	uint64 PeakBytes = 0;
+};
+
+/**
+ * Size-classed pool behind ikcp_allocator for KCP segments, control blocks and flush buffers.
+ * Each thread frees into and allocates from its own cache, overflow and refills go through a locked shared pool per class.
+ * Stays installed for the process lifetime, KCP objects may be freed after the module shuts down.
+ */
+class KCP_API FKCPAllocator
+{
+public:
+
+	static void Install();
+
+	static void LogStats();
+
+	/** Hands the blocks cached by the calling thread to the shared pools, call before a thread that ran KCP exits. */
+	static void ReleaseThreadCache();
+
+	static FKCPAllocatorStats GetStats();
+
+	static void* Malloc(size_t Size);
+
+	static void Free(void* Ptr);
+
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ikcp.h"
+
+/**
+ * Replaces KCP's loss-based window, attach with FKCPWrap::SetCongestionControl.
+ * The controller owns ikcpcb::cwnd from then on, KCP still caps it by the send and remote windows.
+ */
+class KCP_API IKCPCongestionControl
+{
+public:
+
+	virtual ~IKCPCongestionControl() = default;
+
+	virtual void OnAttach(ikcpcb& KCPCB) { }
+
+	virtual void OnRTTSample(ikcpcb& KCPCB, int32 RTT) { }
+
+	virtual void OnAck(ikcpcb& KCPCB, int32 AckedSegments) { }
+
+	/** bTimeout for a retransmission timeout, otherwise a fast resend. */
+	virtual void OnLoss(ikcpcb& KCPCB, int32 InFlight, bool bTimeout) { }
+
+	/** Bytes per second to pace at, 0 without an estimate. */
+	virtual int64 GetPacingRate() const { return 0; }
+
+};
+
+/**
+ * Delay-based controller after BBR, it models the bottleneck bandwidth and the minimum RTT.
+ * The window is kept near one bandwidth-delay product, so queues stay short and random loss does not shrink it.
+ */
+class KCP_API FKCPBBRControl : public IKCPCongestionControl
+{
+public:
+
+	//~ Begin IKCPCongestionControl Interface
+	virtual void OnAttach(ikcpcb& KCPCB) override;
+	virtual void OnRTTSample(ikcpcb& KCPCB, int32 RTT) override;
+	virtual void OnAck(ikcpcb& KCPCB, int32 AckedSegments) override;
+	virtual void OnLoss(ikcpcb& KCPCB, int32 InFlight, bool bTimeout) override;
+	virtual int64 GetPacingRate() const override;
+	//~ End IKCPCongestionControl Interface
+
+private:
+
+	enum class EState : uint8
+	{
+		Startup,
+		Drain,
+		ProbeBW,
+		ProbeRTT,
+	};
+
+	/** Rounds the bandwidth max filter spans. */
+	static constexpr int32 BandwidthWindow = 10;
+
+	static constexpr int32 MinWindow = 4;
+
+	EState State = EState::Startup;
+
+	/** Gains in thousandths. */
+	int32 PacingGain = 2885;
+	int32 WindowGain = 2885;
+
+	int32 MinRTT = MAX_int32;
+	uint32 MinRTTStamp = 0;
+	int32 ProbeMinRTT = MAX_int32;
+	uint32 ProbeRTTDone = 0;
+
+	/** Highest delivery rate of each recent round, bytes per second. */
+	int64 BandwidthSamples[BandwidthWindow] = { };
+	int64 Bandwidth = 0;
+
+	uint32 Round = 0;
+	uint32 RoundStart = 0;
+	int64 RoundDelivered = 0;
+
+	int64 FullBandwidth = 0;
+	int32 FullBandwidthRounds = 0;
+	bool bFullBandwidth = false;
+
+	int32 CycleIndex = 0;
+
+	int32 GetRoundTime() const;
+	int64 GetBDPSegments(const ikcpcb& KCPCB) const;
+
+	void EndRound(ikcpcb& KCPCB);
+	void EnterState(EState NewState);
+	void UpdateWindow(ikcpcb& KCPCB, int32 AckedSegments);
+
+};
@@ -3,6 +3,8 @@
 #include "CoreMinimal.h"
 #include "ikcp.h"
 
+class IKCPCongestionControl;
+
 class KCP_API FKCPWrap
 {
 public:
@@ -13,6 +15,9 @@ public:
 
 	~FKCPWrap();
 
+	/** Millisecond timestamp for Update and Check. */
+	static uint32 Clock();
+
 	ikcpcb& GetKCPCB();
 
 	int Recv(uint8* Data, int32 Count);
@@ -21,7 +26,10 @@ public:
 
 	void Update(uint32 Current);
 
-	void Check(uint32 Current) const;
+	/** Lets at most MaxNewSegments queued segments into flight, ACKs and resends still go out. */
+	void Update(uint32 Current, int32 MaxNewSegments);
+
+	uint32 Check(uint32 Current) const;
 
 	int Input(const uint8* Data, int32 Count);
 
@@ -31,17 +39,32 @@ public:
 
 	int SetMTU(int32 MTU = 1400);
 
+	/** Leaves Reserved writable bytes at the front of every OutputFunc packet, counted in the MTU. Call before sending anything. */
+	int SetReserved(int32 Reserved);
+
 	int SetWindowSize(int32 SentWindow = -1, int32 RecvWindow = -1);
 
 	int GetWaitSent() const;
 
+	/** Nothing to send, resend, acknowledge or probe, Update has no work until the next Send, Input or Recv. */
+	bool IsIdle() const;
+
+	/** Discards whole unsent messages oldest first until Count segments are gone, returns how many were. */
+	int DropSendQueue(int32 Count);
+
 	int SetNoDelay(int32 NoDelay = -1, int32 Internal = -1, int32 FastResend = -1, int32 NC = -1);
 
 	int SetNormalMode();
 
 	int SetTurboMode();
 
-	TFunction<int32(const uint8* Data, int32 Count)> OutputFunc;
+	/** Hands the window to Control instead of KCP's loss-based one, null restores that. */
+	void SetCongestionControl(TSharedPtr<IKCPCongestionControl> Control);
+
+	IKCPCongestionControl* GetCongestionControl() const { return CongestionControl.Get(); }
+
+	/** Data points into the KCP flush buffer and is only valid during the call. */
+	TFunction<int32(uint8* Data, int32 Count)> OutputFunc;
 
 	void SetDebugName(const FString& InDebugName);
 
@@ -53,4 +76,6 @@ private:
 
 	FString DebugName;
 
+	TSharedPtr<IKCPCongestionControl> CongestionControl;
+
 };
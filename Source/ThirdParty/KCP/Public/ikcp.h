@@ -312,13 +312,22 @@ struct IKCPCB
 	int fastlimit;
 	int nocwnd, stream;
 	int logmask;
+	int reserved;
+	int newlimit;	// segments the next flush may move from snd_queue to snd_buf, below zero is unlimited
 	int (*output)(const char *buf, int len, struct IKCPCB *kcp, void *user);
 	void (*writelog)(const char *log, struct IKCPCB *kcp, void *user);
+	void (*congestion)(struct IKCPCB *kcp, int event, IINT32 value, void *user);
 };
 
 
 typedef struct IKCPCB ikcpcb;
 
+// congestion events, an attached callback replaces the loss-based window and sets cwnd
+#define IKCP_CC_RTT				1	// value: rtt sample in ms
+#define IKCP_CC_ACK				2	// value: segments newly acknowledged
+#define IKCP_CC_FASTRESEND		3	// value: segments in flight
+#define IKCP_CC_TIMEOUT			4	// value: segments in flight
+
 #define IKCP_LOG_OUTPUT			1
 #define IKCP_LOG_INPUT			2
 #define IKCP_LOG_SEND			4
@@ -384,12 +393,18 @@ int ikcp_peeksize(const ikcpcb *kcp);
 // change MTU size, default is 1400
 int ikcp_setmtu(ikcpcb *kcp, int mtu);
 
+// reserve header bytes at the front of every output packet, output gets them as writable room
+int ikcp_reserve(ikcpcb *kcp, int reserved);
+
 // set maximum window size: sndwnd=32, rcvwnd=32 by default
 int ikcp_wndsize(ikcpcb *kcp, int sndwnd, int rcvwnd);
 
 // get how many packet is waiting to be sent
 int ikcp_waitsnd(const ikcpcb *kcp);
 
+// discard unsent messages oldest first, whole messages only, returns segments dropped
+int ikcp_dropsnd(ikcpcb *kcp, int count);
+
 // fastest: ikcp_nodelay(kcp, 1, 20, 2, 1)
 // nodelay: 0:disable(default), 1:enable
 // interval: internal update timer interval in millisec, default is 100ms 